@@ -0,0 +1,68 @@
+/* cachestat.c
+
+   Prints the buffer cache counters.  With arguments, runs them
+   as a command line and prints the counters accumulated while it
+   ran instead, e.g. "cachestat cat big-file". */
+
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+
+static void print_stats (const struct cache_stats *);
+
+int
+main (int argc, char *argv[])
+{
+  struct cache_stats before, after;
+  char cmd_line[128];
+  int i;
+
+  if (!cache_stats (&before))
+    {
+      printf ("cachestat: cannot read buffer cache counters\n");
+      return EXIT_FAILURE;
+    }
+  if (argc < 2)
+    {
+      print_stats (&before);
+      return EXIT_SUCCESS;
+    }
+
+  cmd_line[0] = '\0';
+  for (i = 1; i < argc; i++)
+    {
+      if (i > 1)
+        strlcat (cmd_line, " ", sizeof cmd_line);
+      strlcat (cmd_line, argv[i], sizeof cmd_line);
+    }
+  wait (exec (cmd_line));
+  cache_stats (&after);
+
+  after.hits -= before.hits;
+  after.misses -= before.misses;
+  after.evictions -= before.evictions;
+  after.write_backs -= before.write_backs;
+  after.read_aheads -= before.read_aheads;
+  after.read_ahead_hits -= before.read_ahead_hits;
+  after.lock_waits -= before.lock_waits;
+  after.lock_wait_ticks -= before.lock_wait_ticks;
+  print_stats (&after);
+  return EXIT_SUCCESS;
+}
+
+/* Prints S, including the hit ratio it implies. */
+static void
+print_stats (const struct cache_stats *s)
+{
+  unsigned long long lookups = s->hits + s->misses;
+  unsigned permille = lookups > 0 ? s->hits * 1000 / lookups : 0;
+
+  printf ("hits %llu, misses %llu, hit rate %u.%u%%\n",
+          s->hits, s->misses, permille / 10, permille % 10);
+  printf ("evictions %llu, write-backs %llu\n",
+          s->evictions, s->write_backs);
+  printf ("read-aheads %llu, read-ahead hits %llu\n",
+          s->read_aheads, s->read_ahead_hits);
+  printf ("lock waits %llu, lock wait ticks %llu\n",
+          s->lock_waits, s->lock_wait_ticks);
+}
@@ -0,0 +1,100 @@
+/* randread.c
+
+   Reads 512-byte blocks of an 8 MB file at random offsets and
+   reports how many buffer cache lookups each read cost, which
+   exposes any metadata the file system looks up again on every
+   access.  Creates the file first if it does not exist, so the
+   file system disk needs room for it.
+
+   Usage: randread FILE [READS] */
+
+#include <random.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+
+#define FILE_SIZE (8 * 1024 * 1024)
+#define BLOCK_SIZE 512
+#define BLOCK_CNT (FILE_SIZE / BLOCK_SIZE)
+
+static bool make_file (const char *name);
+
+int
+main (int argc, char *argv[])
+{
+  struct cache_stats before, after;
+  unsigned block[BLOCK_SIZE / sizeof (unsigned)];
+  unsigned long long lookups;
+  int reads, fd, i;
+
+  if (argc != 2 && argc != 3)
+    {
+      printf ("usage: randread FILE [READS]\n");
+      return EXIT_FAILURE;
+    }
+  reads = argc == 3 ? atoi (argv[2]) : 1000;
+
+  fd = open (argv[1]);
+  if (fd < 0)
+    {
+      if (!make_file (argv[1]))
+        return EXIT_FAILURE;
+      fd = open (argv[1]);
+    }
+  if (fd < 0 || filesize (fd) != FILE_SIZE)
+    {
+      printf ("%s: not an %d-byte file\n", argv[1], FILE_SIZE);
+      return EXIT_FAILURE;
+    }
+
+  random_init (0);
+  cache_stats (&before);
+  for (i = 0; i < reads; i++)
+    {
+      unsigned idx = random_ulong () % BLOCK_CNT;
+
+      seek (fd, idx * BLOCK_SIZE);
+      if (read (fd, block, BLOCK_SIZE) != BLOCK_SIZE || block[0] != idx)
+        {
+          printf ("%s: bad data in block %u\n", argv[1], idx);
+          return EXIT_FAILURE;
+        }
+    }
+  cache_stats (&after);
+  close (fd);
+
+  lookups = (after.hits + after.misses) - (before.hits + before.misses);
+  printf ("%d random reads: %llu cache lookups, %llu misses, "
+          "%llu.%02llu lookups per read\n",
+          reads, lookups, after.misses - before.misses,
+          lookups / reads, lookups * 100 / reads % 100);
+  return EXIT_SUCCESS;
+}
+
+/* Creates NAME as an 8 MB file whose blocks each start with
+   their own index.  Returns true if successful. */
+static bool
+make_file (const char *name)
+{
+  unsigned block[BLOCK_SIZE / sizeof (unsigned)] = {0};
+  int fd;
+  unsigned idx;
+
+  if (!create (name, 0) || (fd = open (name)) < 0)
+    {
+      printf ("%s: create failed\n", name);
+      return false;
+    }
+  for (idx = 0; idx < BLOCK_CNT; idx++)
+    {
+      block[0] = idx;
+      if (write (fd, block, BLOCK_SIZE) != BLOCK_SIZE)
+        {
+          printf ("%s: write failed at block %u\n", name, idx);
+          close (fd);
+          return false;
+        }
+    }
+  close (fd);
+  return true;
+}
@@ -3,141 +3,1058 @@
 //
 
 #include <debug.h>
+#include <hash.h>
+#include <round.h>
+#include <stdio.h>
 #include <string.h>
 #include "filesys/cache.h"
 #include "filesys/filesys.h"
+#include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "devices/timer.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
-#define BUFFER_CACHE_SIZE 64
+/* Default and minimum number of cached sectors.  A thread can
+   pin a few clusters at once, so a tiny cache could deadlock. */
+#define BUFFER_CACHE_SIZE_DEFAULT 64
+#define BUFFER_CACHE_SIZE_MIN (4 * CLUSTER_SECTORS)
 
+/* 2Q queue bounds: at most A1IN_SIZE entries seen only once stay
+   resident, and the last A1OUT_SIZE clusters evicted from there
+   are remembered so that a re-reference promotes them to the hot
+   queue. */
+#define A1IN_SIZE (cache_cnt / 4)
+#define A1OUT_SIZE (cache_cnt / 2)
+
+/* Default number of timer ticks between write-behind passes. */
+#define FLUSH_INTERVAL_DEFAULT (5 * TIMER_FREQ)
+
+/* Maximum number of pending read-ahead requests.  Requests past
+   this are dropped: read-ahead is only a hint. */
+#define READ_AHEAD_MAX 16
+
+enum bce_state {
+    BCE_FREE,       // caches nothing
+    BCE_MAPPED      // caches the cluster starting at cluster
+};
+
+/* A cache entry.
+
+   cache_lock protects the mapping: state, cluster, pin_cnt, the
+   dirty mask, the accessed bit and list/hash membership.  The
+   entry's own lock protects the contents of buffer and the valid
+   mask and is held across any disk transfer to or from it, so
+   that disk I/O never happens under cache_lock.  A newly mapped
+   entry holds no valid sector: whoever locks it first reads in
+   what it needs.  An entry with a nonzero pin_cnt is in use
+   outside cache_lock and is never evicted.
+
+   Bit I of the valid and dirty masks stands for sector
+   cluster + I.  Only valid sectors are ever dirty. */
 struct buffer_cache_entry {
-    bool occupied;  // true only if this entry is valid cache entry
+    enum bce_state state;
+
+    block_sector_t cluster;         // first sector, a multiple of CLUSTER_SECTORS
+    uint8_t *buffer;                // CLUSTER_SECTORS sectors, one page of cache_pages
+    struct lock lock;               // protects buffer and valid
+    uint8_t valid;                  // sectors of buffer read from or written to the disk
+    enum cache_mode mode;           // mode of the cache_get() holding lock
+    int pin_cnt;                    // number of threads using this entry
+    int write_cnt;                  // write_to_disk() calls writing it back
 
-    block_sector_t disk_sector;
-    uint8_t buffer[BLOCK_SECTOR_SIZE];
+    uint8_t dirty;      // sectors to write back
+    bool accessed;      // accessed bit, cleared by the clock hand
+    bool prefetched;    // loaded by read-ahead and not used since
 
-    bool dirty;     // dirty bit
+    struct list_elem free_elem;     // element in free_list, if free
+    struct list_elem dirty_elem;    // element in dirty_list, if dirty
+    struct hash_elem hash_elem;     // element in cache_index, keyed by cluster
+    struct list_elem queue_elem;    // element in a 2Q queue
+    struct list *queue;             // 2Q queue this entry is in
 };
 
-static struct buffer_cache_entry cache[BUFFER_CACHE_SIZE];
+/* Replacement policy.  Every hook runs with cache_lock held. */
+struct cache_policy {
+    const char *name;
+    void (*reset)(void);                            // forget every entry
+    void (*insert)(struct buffer_cache_entry *);    // entry was just mapped
+    void (*access)(struct buffer_cache_entry *);    // entry was hit
+    struct buffer_cache_entry *(*victim)(void);     // choose an evictable entry, or null
+    void (*remove)(struct buffer_cache_entry *);    // entry is being evicted
+};
+
+/* Number of sectors to cache, set with -cache and rounded up to
+   whole clusters.  Every cluster costs one page of kernel pool
+   memory plus its descriptor. */
+size_t buffer_cache_size = BUFFER_CACHE_SIZE_DEFAULT;
+
+static struct buffer_cache_entry *cache;
+static size_t cache_cnt;
+
+/* Kernel pages backing the entries' buffers, one per entry. */
+static uint8_t *cache_pages;
+
+/* Entries in BCE_FREE. */
+static struct list free_list;
+
+/* Maps the first sector of a cluster to the entry caching it, so
+   that a cache hit does not scan all of cache[]. */
+static struct hash cache_index;
 
 static struct lock cache_lock;
 
-static struct buffer_cache_entry *evict_buffer_cache(void);
+/* Signaled when an entry's pin_cnt drops to zero or the journal
+   releases held sectors, for misses that found no entry to
+   evict. */
+static struct condition cache_unpinned;
+
+/* Signaled when a write_to_disk() call ends. */
+static struct condition cache_written;
+
+/* Dirty entries, the only ones a flush has to write back. */
+static struct list dirty_list;
+
+/* A thread waiting in flush_buffer_cache_ranges(). */
+struct range_flush {
+    const struct sector_range *ranges;  // sectors to write back
+    size_t cnt;                         // number of ranges
+    bool done;                          // written back by some pass
+    struct list_elem elem;              // element in range_flushes
+};
+
+/* Range flushes not yet taken up by a pass, protected by
+   cache_lock.  range_flushing is true while a pass runs, and
+   range_flushed is signaled when it ends. */
+static struct list range_flushes;
+static bool range_flushing;
+static struct condition range_flushed;
+
+/* Ticks between two passes of the write-behind thread, set with
+   -cache-flush.  Zero disables write-behind. */
+int64_t buffer_cache_flush_interval = FLUSH_INTERVAL_DEFAULT;
+
+static const struct cache_policy first_policy, clock_policy, two_queue_policy;
+
+/* Policy chosen at boot with -cache-policy. */
+static const struct cache_policy *cache_policy = &clock_policy;
+
+/* A cluster waiting to be prefetched by the read-ahead thread. */
+struct read_ahead_request {
+    block_sector_t cluster;
+    struct list_elem elem;
+};
+
+/* Pending read_ahead_requests, protected by cache_lock. */
+static struct list read_ahead_queue;
+static int read_ahead_cnt;
+
+/* Upped once per request added to read_ahead_queue. */
+static struct semaphore read_ahead_sema;
+
+/* Counters reported by print_buffer_cache_stats() and the
+   cache_stats system call, protected by cache_lock. */
+static struct cache_stats stats;
+
+static struct buffer_cache_entry *get_bce(block_sector_t cluster);
+
+static struct buffer_cache_entry *allocate_buffer_cache(void);
 
-static struct buffer_cache_entry *get_cache_victim();
+static thread_func read_ahead_daemon NO_RETURN;
 
-static struct buffer_cache_entry *get_bce(block_sector_t sector);
+static thread_func write_behind_daemon NO_RETURN;
 
-static struct buffer_cache_entry *allocate_buffer_cache();
+/* Acquires cache_lock, accounting the time spent waiting for it
+   if another thread holds it. */
+static void acquire_cache_lock(void) {
+    if (lock_try_acquire(&cache_lock))
+        return;
 
+    int64_t start = timer_ticks();
+    lock_acquire(&cache_lock);
+    stats.lock_waits++;
+    stats.lock_wait_ticks += timer_elapsed(start);
+}
+
+static unsigned bce_hash(const struct hash_elem *e, void *aux UNUSED) {
+    const struct buffer_cache_entry *bce = hash_entry(e, struct buffer_cache_entry, hash_elem);
+    return hash_int((int) bce->cluster);
+}
+
+static bool bce_less(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED) {
+    return hash_entry(a, struct buffer_cache_entry, hash_elem)->cluster
+           < hash_entry(b, struct buffer_cache_entry, hash_elem)->cluster;
+}
+
+/* Selects the replacement policy called NAME ("first", "clock" or
+   "2q").  Must be called before init_buffer_cache().  Returns
+   false if there is no such policy. */
+bool set_buffer_cache_policy(const char *name) {
+    static const struct cache_policy *policies[] = {&first_policy, &clock_policy, &two_queue_policy};
+
+    for (size_t i = 0; i < sizeof policies / sizeof *policies; i++) {
+        if (!strcmp(name, policies[i]->name)) {
+            cache_policy = policies[i];
+            return true;
+        }
+    }
+    return false;
+}
 
 void init_buffer_cache(void) {
     lock_init(&cache_lock);
+    cond_init(&cache_unpinned);
+    cond_init(&cache_written);
+    if (!hash_init(&cache_index, bce_hash, bce_less, NULL)) {
+        PANIC("buffer cache index creation failed");
+    }
+
+    /* The buffers come out of the kernel pool, which palloc_init()
+       gives half of free memory unless -ul shrinks the user pool,
+       so a large -cache may also need a smaller -ul. */
+    if (buffer_cache_size < BUFFER_CACHE_SIZE_MIN) {
+        PANIC("buffer cache needs at least %d sectors", BUFFER_CACHE_SIZE_MIN);
+    }
+    cache_cnt = DIV_ROUND_UP(buffer_cache_size, CLUSTER_SECTORS);
+    cache_pages = palloc_get_multiple(0, cache_cnt);
+    cache = calloc(cache_cnt, sizeof *cache);
+    if (cache_pages == NULL || cache == NULL) {
+        PANIC("cannot allocate a %zu-sector buffer cache (try a smaller -cache or -ul)", buffer_cache_size);
+    }
+
+    list_init(&free_list);
+    for (size_t i = 0; i < cache_cnt; ++i) {
+        cache[i].state = BCE_FREE;
+        cache[i].buffer = cache_pages + i * PGSIZE;
+        cache[i].pin_cnt = 0;
+        cache[i].write_cnt = 0;
+        lock_init(&cache[i].lock);
+        list_push_back(&free_list, &cache[i].free_elem);
+    }
+    cache_policy->reset();
+    list_init(&dirty_list);
+    list_init(&range_flushes);
+    range_flushing = false;
+    cond_init(&range_flushed);
+
+    list_init(&read_ahead_queue);
+    read_ahead_cnt = 0;
+    sema_init(&read_ahead_sema, 0);
+    thread_create("read-ahead", PRI_DEFAULT, read_ahead_daemon, NULL);
+
+    if (buffer_cache_flush_interval > 0) {
+        thread_create("write-behind", PRI_DEFAULT, write_behind_daemon, NULL);
+    }
+}
+
+/* Returns the mask of the sectors of BCE's cluster that exist on
+   the file system device, which may end in mid-cluster. */
+static uint8_t cluster_mask(const struct buffer_cache_entry *bce) {
+    block_sector_t cnt = block_size(fs_device) - bce->cluster;
+    return cnt >= CLUSTER_SECTORS ? 0xff : (1u << cnt) - 1;
+}
+
+/* Reads or, if WRITE, writes the sectors of BCE in MASK, with
+   one device request per run of consecutive sectors.  Returns
+   the number of sectors transferred.  BCE's lock must be held. */
+static int transfer_sectors(struct buffer_cache_entry *bce, uint8_t mask, bool write) {
+    ASSERT(lock_held_by_current_thread(&bce->lock));
+
+    int cnt = 0;
+    for (int i = 0; i < CLUSTER_SECTORS;) {
+        if (!(mask & (1u << i))) {
+            i++;
+            continue;
+        }
+        int j = i + 1;
+        while (j < CLUSTER_SECTORS && (mask & (1u << j)))
+            j++;
+
+        uint8_t *data = bce->buffer + i * BLOCK_SECTOR_SIZE;
+        if (write)
+            block_write_multiple(fs_device, bce->cluster + i, data, j - i);
+        else
+            block_read_multiple(fs_device, bce->cluster + i, data, j - i);
+        cnt += j - i;
+        i = j;
+    }
+    return cnt;
+}
 
-    for (int i = 0; i < BUFFER_CACHE_SIZE; ++i) {
-        cache[i].occupied = false;
+/* Reads every sector of BCE that is not valid yet.  BCE's lock
+   must be held. */
+static void fill_bce(struct buffer_cache_entry *bce) {
+    uint8_t missing = cluster_mask(bce) & ~bce->valid;
+
+    if (missing) {
+        transfer_sectors(bce, missing, false);
+        bce->valid |= missing;
+    }
+}
+
+/* Returns the mask of the sectors of BCE in MASK that the journal
+   holds, which must not be written back before they are
+   committed. */
+static uint8_t held_sectors(const struct buffer_cache_entry *bce, uint8_t mask) {
+    uint8_t held = 0;
+
+    for (int i = 0; i < CLUSTER_SECTORS; i++) {
+        if ((mask & (1u << i)) && journal_is_held(bce->cluster + i))
+            held |= 1u << i;
     }
+    return held;
 }
 
+/* Marks the sectors of BCE in DIRTY as needing write-back. */
+static void set_dirty(struct buffer_cache_entry *bce, uint8_t dirty) {
+    ASSERT(lock_held_by_current_thread(&cache_lock));
+
+    if (dirty) {
+        if (!bce->dirty)
+            list_push_back(&dirty_list, &bce->dirty_elem);
+        bce->dirty |= dirty;
+    }
+}
+
+/* Writes BCE's dirty sectors back to disk, if any, except those
+   the journal holds, which stay dirty.  Must be called with
+   cache_lock held, which is released during the write, so the
+   caller has to revalidate anything it looked up before. */
 static void write_to_disk(struct buffer_cache_entry *bce) {
     ASSERT(lock_held_by_current_thread(&cache_lock));
-    ASSERT(bce != NULL && bce->occupied);
+    ASSERT(bce != NULL && bce->state == BCE_MAPPED);
 
     if (bce->dirty) {
-        block_write(fs_device, bce->disk_sector, bce->buffer);
-        bce->dirty = false;
+        /* Clear the dirty mask before writing: a writer that changes
+           the buffer meanwhile sets it again.  An entry left with
+           held sectors goes to the back of dirty_list. */
+        uint8_t dirty = bce->dirty & ~held_sectors(bce, bce->dirty);
+        bce->dirty &= ~dirty;
+        list_remove(&bce->dirty_elem);
+        if (bce->dirty)
+            list_push_back(&dirty_list, &bce->dirty_elem);
+        if (!dirty)
+            return;
+        bce->pin_cnt++;
+        bce->write_cnt++;
+        lock_release(&cache_lock);
+
+        /* A sector logged since the mask was taken may have been
+           changed by whoever locked the entry first, and hold
+           uncommitted data.  Look again now that the lock is ours
+           and leave such a sector dirty until its commit. */
+        lock_acquire(&bce->lock);
+        uint8_t held = held_sectors(bce, dirty);
+        int cnt = transfer_sectors(bce, dirty & ~held, true);
+        lock_release(&bce->lock);
+
+        acquire_cache_lock();
+        set_dirty(bce, held);
+        stats.write_backs += cnt;
+        bce->write_cnt--;
+        cond_broadcast(&cache_written, &cache_lock);
+        if (--bce->pin_cnt == 0)
+            cond_broadcast(&cache_unpinned, &cache_lock);
     }
 }
 
+static bool dirty_less(const struct list_elem *a, const struct list_elem *b, void *aux UNUSED) {
+    return list_entry(a, struct buffer_cache_entry, dirty_elem)->cluster
+           < list_entry(b, struct buffer_cache_entry, dirty_elem)->cluster;
+}
+
+/* Writes back every dirty entry, in ascending sector order so
+   that the disk head sweeps once across the device, and returns
+   once they are on disk.  Entries dirtied while the flush runs
+   are left for the next one, as are sectors the journal holds. */
 void flush_buffer_cache(void) {
-    lock_acquire(&cache_lock);
+    struct list batch;
+
+    acquire_cache_lock();
+
+    list_init(&batch);
+    list_sort(&dirty_list, dirty_less, NULL);
+    if (!list_empty(&dirty_list)) {
+        list_splice(list_end(&batch), list_begin(&dirty_list), list_end(&dirty_list));
+    }
+    while (!list_empty(&batch)) {
+        write_to_disk(list_entry(list_front(&batch), struct buffer_cache_entry, dirty_elem));
+    }
+
+    /* Write-backs that other threads started before the flush,
+       such as an eviction, took their entries off dirty_list but
+       may still be running.  Wait for them too: the journal
+       relies on this to reuse its log after a checkpoint. */
+    for (size_t i = 0; i < cache_cnt; i++) {
+        while (cache[i].write_cnt > 0)
+            cond_wait(&cache_written, &cache_lock);
+    }
+
+    lock_release(&cache_lock);
+}
+
+/* Returns true if one of the sectors of BCE's cluster belongs to
+   one of the CNT RANGES. */
+static bool overlaps_ranges(const struct buffer_cache_entry *bce, const struct sector_range *ranges, size_t cnt) {
+    for (size_t i = 0; i < cnt; i++) {
+        if (ranges[i].start < bce->cluster + CLUSTER_SECTORS && bce->cluster < ranges[i].start + ranges[i].cnt)
+            return true;
+    }
+    return false;
+}
+
+/* Writes back the dirty sectors in the CNT RANGES, along with the
+   rest of their clusters, and returns once they are on disk.
+
+   Threads that call this while a pass is running wait for it to
+   end and are then served together by a single pass, which
+   writes the dirty entries of all their ranges in one ascending
+   sweep.  Sectors the journal holds are left dirty. */
+void flush_buffer_cache_ranges(const struct sector_range *ranges, size_t cnt) {
+    struct range_flush self;
+    struct list waiters, batch;
 
-    for (int i = 0; i < BUFFER_CACHE_SIZE; i++) {
-        if (cache[i].occupied) {
-            write_to_disk(&(cache[i]));
+    self.ranges = ranges;
+    self.cnt = cnt;
+    self.done = false;
+
+    acquire_cache_lock();
+    list_push_back(&range_flushes, &self.elem);
+    while (range_flushing && !self.done)
+        cond_wait(&range_flushed, &cache_lock);
+
+    if (!self.done) {
+        /* Take up every waiting flush, ours included. */
+        range_flushing = true;
+        list_init(&waiters);
+        list_splice(list_end(&waiters), list_begin(&range_flushes), list_end(&range_flushes));
+
+        list_init(&batch);
+        for (struct list_elem *e = list_begin(&dirty_list); e != list_end(&dirty_list);) {
+            struct buffer_cache_entry *bce = list_entry(e, struct buffer_cache_entry, dirty_elem);
+            e = list_next(e);
+            for (struct list_elem *w = list_begin(&waiters); w != list_end(&waiters); w = list_next(w)) {
+                struct range_flush *f = list_entry(w, struct range_flush, elem);
+                if (overlaps_ranges(bce, f->ranges, f->cnt)) {
+                    list_remove(&bce->dirty_elem);
+                    list_push_back(&batch, &bce->dirty_elem);
+                    break;
+                }
+            }
+        }
+        list_sort(&batch, dirty_less, NULL);
+        while (!list_empty(&batch)) {
+            write_to_disk(list_entry(list_front(&batch), struct buffer_cache_entry, dirty_elem));
         }
+
+        while (!list_empty(&waiters)) {
+            list_entry(list_pop_front(&waiters), struct range_flush, elem)->done = true;
+        }
+        range_flushing = false;
+        cond_broadcast(&range_flushed, &cache_lock);
     }
 
     lock_release(&cache_lock);
 }
 
-void read_buffer_cache(block_sector_t sector, void *target) {
-    lock_acquire(&cache_lock);
-    struct buffer_cache_entry *bce = get_bce(sector);
-    if (!bce) {
+/* Flushes the cache every buffer_cache_flush_interval ticks, which
+   bounds how much written data a crash can lose and keeps
+   eviction from having to write back on the foreground path.
+   Files' delayed appends get their sectors first.  Committing the
+   journal then puts the free map's pending changes in the cache
+   and releases the metadata it holds, so each flush writes it out
+   along with the inodes it describes. */
+static void write_behind_daemon(void *aux UNUSED) {
+    for (;;) {
+        timer_sleep(buffer_cache_flush_interval);
+        inode_flush_delayed();
+        journal_commit();
+        flush_buffer_cache();
+    }
+}
+
+/* Returns the entry caching CLUSTER, pinned, mapping a newly
+   allocated entry on a miss.  The caller reads in the sectors it
+   needs with fill_bce() under the entry's lock, so concurrent
+   misses on one cluster share a single read.  PREFETCH is true
+   for loads on behalf of the read-ahead thread, which count as
+   read-aheads rather than as hits or misses.  Must be called with
+   cache_lock held, which may be released to make room. */
+static struct buffer_cache_entry *pin_bce(block_sector_t cluster, bool prefetch) {
+    ASSERT(lock_held_by_current_thread(&cache_lock));
+    ASSERT(cluster % CLUSTER_SECTORS == 0);
+
+    struct buffer_cache_entry *bce;
+    for (;;) {
+        bce = get_bce(cluster);
+        if (bce) {
+            bce->pin_cnt++;
+            if (!prefetch) {
+                stats.hits++;
+                if (bce->prefetched) {
+                    bce->prefetched = false;
+                    stats.read_ahead_hits++;
+                }
+            }
+            cache_policy->access(bce);
+            return bce;
+        }
+
+        /* Allocation may have dropped cache_lock, in which case
+           another thread may have mapped CLUSTER: look again. */
         bce = allocate_buffer_cache();
-        ASSERT(bce != NULL && bce->occupied == false);
+        if (bce != NULL)
+            break;
+    }
+
+    if (prefetch)
+        stats.read_aheads++;
+    else
+        stats.misses++;
+    bce->state = BCE_MAPPED;
+    bce->cluster = cluster;
+    bce->valid = 0;
+    bce->dirty = 0;
+    bce->prefetched = prefetch;
+    bce->pin_cnt = 1;
+    hash_insert(&cache_index, &bce->hash_elem);
+    cache_policy->insert(bce);
 
-        bce->occupied = true;
-        bce->disk_sector = sector;
-        bce->dirty = false;
-        block_read(fs_device, sector, bce->buffer);
+    /* Take back the uncommitted sectors evicted into the journal's
+       stash.  No one else can have locked the entry yet. */
+    uint8_t stashed = 0;
+    for (int i = 0; i < CLUSTER_SECTORS; i++) {
+        if (journal_unstash(cluster + i, bce->buffer + i * BLOCK_SECTOR_SIZE))
+            stashed |= 1u << i;
     }
+    bce->valid = stashed;
+    set_dirty(bce, stashed);
+    return bce;
+}
+
+/* Drops a pin taken by pin_bce(), marking the sectors in DIRTY
+   dirty first. */
+static void unpin_bce(struct buffer_cache_entry *bce, uint8_t dirty) {
+    ASSERT(lock_held_by_current_thread(&cache_lock));
+    ASSERT(bce->pin_cnt > 0);
+
+    set_dirty(bce, dirty);
+    if (--bce->pin_cnt == 0)
+        cond_broadcast(&cache_unpinned, &cache_lock);
+}
+
+/* Returns the entry whose buffer holds DATA, a sector returned by
+   cache_get(), and stores the sector's index within the cluster
+   in *IDX. */
+static struct buffer_cache_entry *data_to_bce(const void *data, int *idx) {
+    size_t ofs = (const uint8_t *) data - cache_pages;
+    ASSERT(ofs / PGSIZE < cache_cnt && ofs % BLOCK_SECTOR_SIZE == 0);
+    *idx = ofs % PGSIZE / BLOCK_SECTOR_SIZE;
+    return &cache[ofs / PGSIZE];
+}
+
+/* Borrows SECTOR: returns a pointer to its BLOCK_SECTOR_SIZE
+   bytes in the cache, to be used in place until the matching
+   cache_put().  The caller may modify the data only if MODE is
+   CACHE_WRITE, and must overwrite all of it if MODE is
+   CACHE_OVERWRITE, in which case a miss does not read the disk.
+   Otherwise a miss reads the rest of SECTOR's cluster along with
+   it.  The whole cluster stays locked while borrowed, so keep the
+   borrow short and do not borrow a second sector: it could be in
+   the same cluster, or someone could be borrowing the two in the
+   opposite order. */
+void *cache_get(block_sector_t sector, enum cache_mode mode) {
+    int idx = sector % CLUSTER_SECTORS;
+
+    acquire_cache_lock();
+    struct buffer_cache_entry *bce = pin_bce(sector - idx, false);
+    lock_release(&cache_lock);
+
+    lock_acquire(&bce->lock);
+    if (mode != CACHE_OVERWRITE && !(bce->valid & (1u << idx)))
+        fill_bce(bce);
+    bce->mode = mode;
+    return bce->buffer + idx * BLOCK_SECTOR_SIZE;
+}
 
+/* Returns DATA, obtained from cache_get(), to the cache.  DIRTY
+   says whether the caller modified it. */
+void cache_put(const void *data, bool dirty) {
+    int idx;
+    struct buffer_cache_entry *bce = data_to_bce(data, &idx);
+    ASSERT(lock_held_by_current_thread(&bce->lock));
+    ASSERT(bce->mode == CACHE_READ ? !dirty : bce->mode == CACHE_WRITE || dirty);
+    if (bce->mode == CACHE_OVERWRITE)
+        bce->valid |= 1u << idx;
+    lock_release(&bce->lock);
+
+    acquire_cache_lock();
+    unpin_bce(bce, dirty ? 1u << idx : 0);
+    lock_release(&cache_lock);
+}
+
+void read_buffer_cache(block_sector_t sector, void *target) {
+    const void *data = cache_get(sector, CACHE_READ);
     // copy from entry to target
-    memcpy(target, bce->buffer, BLOCK_SECTOR_SIZE);
+    memcpy(target, data, BLOCK_SECTOR_SIZE);
+    cache_put(data, false);
+}
+
+void write_buffer_cache(block_sector_t sector, const void *source) {
+    write_buffer_cache_at(sector, source, 0, BLOCK_SECTOR_SIZE);
+}
 
+/* Writes SIZE bytes from SOURCE into SECTOR, starting OFS bytes
+   into the sector, merging them in place with the rest of the
+   cached sector.  A write covering the whole sector does not read
+   it from disk first. */
+void write_buffer_cache_at(block_sector_t sector, const void *source, int ofs, int size) {
+    ASSERT(ofs >= 0 && size >= 0 && ofs + size <= BLOCK_SECTOR_SIZE);
+
+    enum cache_mode mode = size == BLOCK_SECTOR_SIZE ? CACHE_OVERWRITE : CACHE_WRITE;
+    uint8_t *data = cache_get(sector, mode);
+    memcpy(data + ofs, source, size);
+    cache_put(data, true);
+}
+
+/* Copies SIZE bytes from SRC, starting SRC_OFS bytes into it, to
+   DST at DST_OFS, straight from one cached sector to the other.
+   Only a DST that is not entirely overwritten is read from disk
+   first.
+
+   This is the one place that holds two clusters at once.  It
+   locks them in ascending order, and cache_get() callers never
+   hold one cluster while waiting for another, so it cannot
+   deadlock. */
+void copy_buffer_cache(block_sector_t src, int src_ofs, block_sector_t dst, int dst_ofs, int size) {
+    int src_idx = src % CLUSTER_SECTORS;
+    int dst_idx = dst % CLUSTER_SECTORS;
+
+    ASSERT(src_ofs >= 0 && size >= 0 && src_ofs + size <= BLOCK_SECTOR_SIZE);
+    ASSERT(dst_ofs >= 0 && dst_ofs + size <= BLOCK_SECTOR_SIZE);
+
+    acquire_cache_lock();
+    struct buffer_cache_entry *from = pin_bce(src - src_idx, false);
+    struct buffer_cache_entry *to = pin_bce(dst - dst_idx, false);
+    lock_release(&cache_lock);
+
+    struct buffer_cache_entry *first = from->cluster <= to->cluster ? from : to;
+    struct buffer_cache_entry *second = first == from ? to : from;
+    lock_acquire(&first->lock);
+    if (second != first)
+        lock_acquire(&second->lock);
+    if (!(from->valid & (1u << src_idx)))
+        fill_bce(from);
+    if (size < BLOCK_SECTOR_SIZE && !(to->valid & (1u << dst_idx)))
+        fill_bce(to);
+    memcpy(to->buffer + dst_idx * BLOCK_SECTOR_SIZE + dst_ofs,
+           from->buffer + src_idx * BLOCK_SECTOR_SIZE + src_ofs, size);
+    to->valid |= 1u << dst_idx;
+    if (second != first)
+        lock_release(&second->lock);
+    lock_release(&first->lock);
+
+    acquire_cache_lock();
+    unpin_bce(from, 0);
+    unpin_bce(to, 1u << dst_idx);
     lock_release(&cache_lock);
 }
 
-void write_buffer_cache(block_sector_t sector, void *source) {
-    lock_acquire(&cache_lock);
+/* Asks the read-ahead thread to bring SECTOR's cluster into the
+   cache in the background, unless it is already cached. */
+void read_ahead_buffer_cache(block_sector_t sector) {
+    block_sector_t cluster = ROUND_DOWN(sector, CLUSTER_SECTORS);
 
-    struct buffer_cache_entry *bce = get_bce(sector);
-    if (!bce) {
-        bce = allocate_buffer_cache();
-        ASSERT(bce != NULL && bce->occupied == false);
+    acquire_cache_lock();
+    if (get_bce(cluster) == NULL && read_ahead_cnt < READ_AHEAD_MAX) {
+        struct read_ahead_request *req = malloc(sizeof *req);
+        if (req != NULL) {
+            req->cluster = cluster;
+            list_push_back(&read_ahead_queue, &req->elem);
+            read_ahead_cnt++;
+            sema_up(&read_ahead_sema);
+        }
+    }
+    lock_release(&cache_lock);
+}
+
+/* Loads the clusters queued by read_ahead_buffer_cache(), one at
+   a time.  A cluster a reader fetched on its own in the meantime
+   is skipped. */
+static void read_ahead_daemon(void *aux UNUSED) {
+    for (;;) {
+        sema_down(&read_ahead_sema);
+
+        acquire_cache_lock();
+        struct read_ahead_request *req = list_entry(list_pop_front(&read_ahead_queue),
+                                                    struct read_ahead_request, elem);
+        read_ahead_cnt--;
+        if (get_bce(req->cluster) == NULL) {
+            struct buffer_cache_entry *bce = pin_bce(req->cluster, true);
+            lock_release(&cache_lock);
+
+            lock_acquire(&bce->lock);
+            fill_bce(bce);
+            lock_release(&bce->lock);
 
-        bce->occupied = true;
-        bce->disk_sector = sector;
-        bce->dirty = false;
-        block_read(fs_device, sector, bce->buffer);
+            acquire_cache_lock();
+            unpin_bce(bce, 0);
+        }
+        lock_release(&cache_lock);
+
+        free(req);
     }
+}
 
-    bce->dirty = true;
-    memcpy(bce->buffer, source, BLOCK_SECTOR_SIZE);
+/* Copies the buffer cache counters into S, which must be kernel
+   memory: cache_lock is held while it is written. */
+void get_buffer_cache_stats(struct cache_stats *s) {
+    acquire_cache_lock();
+    *s = stats;
+    lock_release(&cache_lock);
+}
+
+/* Prints the buffer cache counters. */
+void print_buffer_cache_stats(void) {
+    struct cache_stats s;
+    get_buffer_cache_stats(&s);
+
+    unsigned long long lookups = s.hits + s.misses;
+    unsigned permille = lookups > 0 ? s.hits * 1000 / lookups : 0;
+
+    printf("Buffer cache (%s): %llu hits, %llu misses, %u.%u%% hit rate\n",
+           cache_policy->name, s.hits, s.misses, permille / 10, permille % 10);
+    printf("Buffer cache: %llu evictions, %llu write-backs, %llu read-aheads (%llu used)\n",
+           s.evictions, s.write_backs, s.read_aheads, s.read_ahead_hits);
+    printf("Buffer cache: lock contended %llu times, %llu ticks waiting\n",
+           s.lock_waits, s.lock_wait_ticks);
+}
+
+static struct buffer_cache_entry *get_bce(block_sector_t cluster) {
+    ASSERT(lock_held_by_current_thread(&cache_lock));
 
+    struct buffer_cache_entry key;
+    key.cluster = cluster;
+    struct hash_elem *e = hash_find(&cache_index, &key.hash_elem);
+    // cache hit if found.
+    return e != NULL ? hash_entry(e, struct buffer_cache_entry, hash_elem) : NULL;
+}
+
+/* Returns true if BCE may be evicted right now: it is unpinned
+   and holds no sector the journal has yet to commit. */
+static bool is_evictable(const struct buffer_cache_entry *bce) {
+    return bce->state == BCE_MAPPED && bce->pin_cnt == 0 && !(bce->dirty & held_sectors(bce, bce->dirty));
+}
+
+/* Wakes the threads waiting for an evictable entry.  Called by
+   the journal once it lets held sectors go home. */
+void wake_buffer_cache(void) {
+    acquire_cache_lock();
+    cond_broadcast(&cache_unpinned, &cache_lock);
     lock_release(&cache_lock);
 }
 
-static struct buffer_cache_entry *get_bce(block_sector_t sector) {
-    for (int i = 0; i < BUFFER_CACHE_SIZE; ++i) {
-        if (cache[i].occupied && cache[i].disk_sector == sector) {
-            // cache hit.
-            return &(cache[i]);
+/* Unmaps clean, unpinned entry BCE and returns it to BCE_FREE. */
+static void discard_bce(struct buffer_cache_entry *bce) {
+    ASSERT(lock_held_by_current_thread(&cache_lock));
+    ASSERT(is_evictable(bce) && !bce->dirty);
+
+    cache_policy->remove(bce);
+    hash_delete(&cache_index, &bce->hash_elem);
+    bce->state = BCE_FREE;
+}
+
+/* Looks for an unpinned entry whose only obstacle to eviction is
+   the sectors the journal holds, which must never be written home
+   before they are committed, and moves those into the journal's
+   stash.  A group is committed before it spans half of the cache,
+   but a single transaction can hold more than all of it.  Returns
+   the entry, now evictable, or one that has other dirty sectors
+   to write back before its held ones can be stashed, or a null
+   pointer if there is none or memory is short. */
+static struct buffer_cache_entry *stash_held_sectors(void) {
+    ASSERT(lock_held_by_current_thread(&cache_lock));
+
+    struct buffer_cache_entry *mixed = NULL;
+    for (size_t i = 0; i < cache_cnt; i++) {
+        struct buffer_cache_entry *bce = &cache[i];
+        if (bce->state != BCE_MAPPED || bce->pin_cnt > 0)
+            continue;
+        uint8_t held = held_sectors(bce, bce->dirty);
+        if (!held)
+            continue;
+        if (bce->dirty != held) {
+            mixed = bce;
+            continue;
         }
+
+        /* Unpinned, so no one has the buffer locked.  Stash all of
+           them or none, since the entry stays mapped otherwise. */
+        for (int j = 0; j < CLUSTER_SECTORS; j++) {
+            if ((held & (1u << j))
+                && !journal_stash(bce->cluster + j, bce->buffer + j * BLOCK_SECTOR_SIZE)) {
+                while (j-- > 0) {
+                    if (held & (1u << j))
+                        journal_unstash(bce->cluster + j, bce->buffer + j * BLOCK_SECTOR_SIZE);
+                }
+                return NULL;
+            }
+        }
+        bce->dirty = 0;
+        list_remove(&bce->dirty_elem);
+        return bce;
     }
-    return NULL;
+
+    return mixed;
 }
 
-static struct buffer_cache_entry *evict_buffer_cache(void) {
+/* Returns a free entry, evicting one if necessary.  Returns a null
+   pointer instead if cache_lock had to be released, either to
+   write back a dirty victim or to wait for an entry to be
+   unpinned; the caller must then retry its lookup. */
+static struct buffer_cache_entry *allocate_buffer_cache(void) {
     ASSERT(lock_held_by_current_thread(&cache_lock));
 
-    struct buffer_cache_entry *slot = get_cache_victim();
+    if (!list_empty(&free_list)) {
+        return list_entry(list_pop_front(&free_list), struct buffer_cache_entry, free_elem);
+    }
+
+    struct buffer_cache_entry *slot = cache_policy->victim();
+    ASSERT(slot == NULL || is_evictable(slot));
+    if (slot == NULL)
+        slot = stash_held_sectors();
+    if (slot == NULL) {
+        /* Every entry is pinned, or holds metadata the journal has
+           yet to commit and there was no memory to stash it.  Wait
+           for an unpin or for that commit. */
+        cond_wait(&cache_unpinned, &cache_lock);
+        return NULL;
+    }
     if (slot->dirty) {
         // write back into disk
         write_to_disk(slot);
+        return NULL;
     }
 
-    slot->occupied = false;
+    discard_bce(slot);
+    stats.evictions++;
     return slot;
 }
 
-static struct buffer_cache_entry *allocate_buffer_cache(){
-    for (int i = 0; i < BUFFER_CACHE_SIZE; i++) {
-        if (!cache[i].occupied) {
+static void nop_reset(void) {
+}
+
+static void nop_hook(struct buffer_cache_entry *bce UNUSED) {
+}
+
+/* "first": evicts the lowest-numbered evictable slot. */
+static struct buffer_cache_entry *first_victim(void) {
+    for (size_t i = 0; i < cache_cnt; i++) {
+        if (is_evictable(&cache[i])) {
             return &(cache[i]);
         }
     }
-    return evict_buffer_cache();
+    return NULL;
+}
+
+static const struct cache_policy first_policy = {"first", nop_reset, nop_hook, nop_hook, first_victim, nop_hook};
+
+/* "clock": second-chance sweep over cache[]. */
+static size_t clock_hand;
+
+static void clock_reset(void) {
+    clock_hand = 0;
+}
+
+static void clock_access(struct buffer_cache_entry *bce) {
+    bce->accessed = true;
+}
+
+static struct buffer_cache_entry *clock_victim(void) {
+    /* Two sweeps clear every accessed bit, so if nothing turned
+       up by then everything is pinned or loading. */
+    for (size_t i = 0; i < 2 * cache_cnt; i++) {
+        struct buffer_cache_entry *bce = &cache[clock_hand];
+        clock_hand = (clock_hand + 1) % cache_cnt;
+
+        if (!is_evictable(bce))
+            continue;
+        if (bce->accessed)
+            bce->accessed = false;
+        else
+            return bce;
+    }
+    return NULL;
+}
+
+static const struct cache_policy clock_policy = {"clock", clock_reset, clock_access, clock_access, clock_victim,
+                                                 nop_hook};
+
+/* "2q": clusters referenced once wait in the FIFO a1in, so that a
+   sequential scan cannot flush out the LRU queue am of clusters
+   referenced again, such as inodes, directories and the free map.
+   a1out lists the clusters last evicted from a1in, oldest first. */
+static struct list a1in, am;
+static size_t a1in_cnt;
+static block_sector_t *a1out;
+static size_t a1out_cnt;
+
+static void two_queue_reset(void) {
+    list_init(&a1in);
+    list_init(&am);
+    a1in_cnt = 0;
+    a1out_cnt = 0;
+    if (a1out == NULL) {
+        a1out = malloc(A1OUT_SIZE * sizeof *a1out);
+        if (a1out == NULL)
+            PANIC("cannot allocate 2Q ghost list");
+    }
+}
+
+/* Removes CLUSTER from a1out.  Returns true if it was there. */
+static bool a1out_remove(block_sector_t cluster) {
+    for (size_t i = 0; i < a1out_cnt; i++) {
+        if (a1out[i] == cluster) {
+            memmove(&a1out[i], &a1out[i + 1], (--a1out_cnt - i) * sizeof *a1out);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void a1out_push(block_sector_t cluster) {
+    if (a1out_cnt == A1OUT_SIZE) {
+        memmove(&a1out[0], &a1out[1], --a1out_cnt * sizeof *a1out);
+    }
+    a1out[a1out_cnt++] = cluster;
+}
+
+static void two_queue_insert(struct buffer_cache_entry *bce) {
+    if (a1out_remove(bce->cluster)) {
+        bce->queue = &am;
+    } else {
+        bce->queue = &a1in;
+        a1in_cnt++;
+    }
+    list_push_front(bce->queue, &bce->queue_elem);
+}
+
+static void two_queue_access(struct buffer_cache_entry *bce) {
+    if (bce->queue == &am) {
+        list_remove(&bce->queue_elem);
+        list_push_front(&am, &bce->queue_elem);
+    }
+}
+
+/* Returns the least recently queued evictable entry of QUEUE. */
+static struct buffer_cache_entry *queue_victim(struct list *queue) {
+    for (struct list_elem *e = list_rbegin(queue); e != list_rend(queue); e = list_prev(e)) {
+        struct buffer_cache_entry *bce = list_entry(e, struct buffer_cache_entry, queue_elem);
+        if (is_evictable(bce))
+            return bce;
+    }
+    return NULL;
 }
 
-static struct buffer_cache_entry *get_cache_victim() {
-    for (int i = 0; i < BUFFER_CACHE_SIZE; i++) {
-        if (cache[i].occupied) {
+static struct buffer_cache_entry *two_queue_victim(void) {
+    struct buffer_cache_entry *bce = NULL;
+
+    if (a1in_cnt > A1IN_SIZE)
+        bce = queue_victim(&a1in);
+    if (bce == NULL)
+        bce = queue_victim(&am);
+    if (bce == NULL)
+        bce = queue_victim(&a1in);
+    return bce;
+}
+
+static void two_queue_remove(struct buffer_cache_entry *bce) {
+    list_remove(&bce->queue_elem);
+    if (bce->queue == &a1in) {
+        a1in_cnt--;
+        a1out_push(bce->cluster);
+    }
+}
+
+static const struct cache_policy two_queue_policy = {"2q", two_queue_reset, two_queue_insert, two_queue_access,
+                                                     two_queue_victim, two_queue_remove};
+
+/* Linear scan over cache[], the lookup strategy get_bce() used
+   before cache_index existed.  Kept only as a baseline for
+   bench_buffer_cache(). */
+static struct buffer_cache_entry *get_bce_linear(block_sector_t cluster) {
+    for (size_t i = 0; i < cache_cnt; ++i) {
+        if (cache[i].state != BCE_FREE && cache[i].cluster == cluster) {
             return &(cache[i]);
         }
     }
     return NULL;
-}
\ No newline at end of file
+}
+
+/* Returns the average cost in nanoseconds of looking up one of
+   the first RESIDENT clusters with LOOKUP, including the
+   cache_lock round trip every real access pays.  Lookups are
+   repeated for a fixed number of timer ticks since a single one
+   is far shorter than a tick.  A cluster that another thread
+   evicted meanwhile simply counts as a miss. */
+static unsigned bench_lookup(struct buffer_cache_entry *(*lookup)(block_sector_t), size_t resident) {
+    const int bench_ticks = 20;
+    unsigned long long lookups = 0;
+    unsigned idx = 0;
+
+    int64_t start = timer_ticks();
+    while (timer_ticks() == start)
+        continue;
+    start = timer_ticks();
+    while (timer_elapsed(start) < bench_ticks) {
+        for (int i = 0; i < 256; i++) {
+            lock_acquire(&cache_lock);
+            lookup(idx++ * 7 % resident * CLUSTER_SECTORS);
+            lock_release(&cache_lock);
+        }
+        lookups += 256;
+    }
+    return (unsigned) (1000000000ULL * bench_ticks / TIMER_FREQ / lookups);
+}
+
+/* Kernel action "cache-bench": reports the cost of a cache hit
+   as the number of resident entries grows, for the hashed index
+   and for a linear scan of cache[].  Writes back and drops
+   every cached cluster first, so it is safe to run at any point
+   of the action list.  Entries another thread is still using, or
+   has dirtied again, are left alone and the benchmark only fills
+   the others. */
+void bench_buffer_cache(char **argv UNUSED) {
+    uint8_t sector[BLOCK_SECTOR_SIZE];
+
+    /* Commit first, so that the journal holds nothing back from
+       the flush. */
+    journal_commit();
+    flush_buffer_cache();
+    acquire_cache_lock();
+    for (size_t i = 0; i < cache_cnt; ++i) {
+        if (is_evictable(&cache[i]) && !cache[i].dirty) {
+            discard_bce(&cache[i]);
+            list_push_back(&free_list, &cache[i].free_elem);
+        }
+    }
+    size_t max_resident = list_size(&free_list);
+    lock_release(&cache_lock);
+
+    if (block_size(fs_device) / CLUSTER_SECTORS < max_resident)
+        max_resident = block_size(fs_device) / CLUSTER_SECTORS;
+
+    printf("Buffer cache lookup cost (%zu slots):\n", cache_cnt);
+    printf("%10s %12s %12s\n", "resident", "hash (ns)", "linear (ns)");
+    size_t loaded = 0;
+    for (size_t resident = 1; resident <= max_resident; resident *= 2) {
+        for (; loaded < resident; loaded++) {
+            read_buffer_cache(loaded * CLUSTER_SECTORS, sector);
+        }
+        printf("%10zu %12u %12u\n", resident,
+               bench_lookup(get_bce, resident), bench_lookup(get_bce_linear, resident));
+    }
+}
@@ -2,12 +2,59 @@
 // Created by tykimseoul on 2019-12-02.
 //
 
+#include <cache-stats.h>
+#include <stdbool.h>
 #include "devices/block.h"
+#include "threads/vaddr.h"
+
+/* Each entry caches one page-sized cluster of CLUSTER_SECTORS
+   consecutive sectors, starting at a multiple of CLUSTER_SECTORS,
+   and fills or writes it back with a single device request. */
+#define CLUSTER_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+extern size_t buffer_cache_size;
+
+extern int64_t buffer_cache_flush_interval;
+
+/* CNT consecutive sectors starting at START. */
+struct sector_range {
+    block_sector_t start;
+    block_sector_t cnt;
+};
+
+/* How a borrowed sector will be used, see cache_get(). */
+enum cache_mode {
+    CACHE_READ,     // read only
+    CACHE_WRITE,    // read and modified in place
+    CACHE_OVERWRITE // entirely overwritten, never read
+};
+
+bool set_buffer_cache_policy(const char *name);
 
 void init_buffer_cache(void);
 
 void flush_buffer_cache(void);
 
+void flush_buffer_cache_ranges(const struct sector_range *ranges, size_t cnt);
+
 void read_buffer_cache(block_sector_t sector, void *target);
 
-void write_buffer_cache(block_sector_t sector, void *source);
+void write_buffer_cache(block_sector_t sector, const void *source);
+
+void write_buffer_cache_at(block_sector_t sector, const void *source, int ofs, int size);
+
+void copy_buffer_cache(block_sector_t src, int src_ofs, block_sector_t dst, int dst_ofs, int size);
+
+void *cache_get(block_sector_t sector, enum cache_mode mode);
+
+void cache_put(const void *data, bool dirty);
+
+void read_ahead_buffer_cache(block_sector_t sector);
+
+void wake_buffer_cache(void);
+
+void get_buffer_cache_stats(struct cache_stats *s);
+
+void print_buffer_cache_stats(void);
+
+void bench_buffer_cache(char **argv);
@@ -1,11 +1,33 @@
 #include "../filesys/directory.h"
+#include <hash.h>
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 #include "../threads/thread.h"
 
+/* Identifies a directory with a hash index. */
+#define DIR_INDEX_MAGIC 0x44494458
+
+/* Entries a directory needs before dir_add() gives it an index.
+   Smaller directories take no more than a couple of sector reads
+   to scan. */
+#define DIR_INDEX_MIN_ENTRIES 64
+
+/* Fewest slots in an index, and how many slots per live entry a
+   newly built index gets. */
+#define DIR_INDEX_MIN_SLOTS 128
+#define DIR_INDEX_SLOTS_PER_ENTRY 4
+
+/* Marks an index slot whose entry was removed. */
+#define SLOT_DELETED UINT32_MAX
+
+/* Most names the dentry cache remembers. */
+#define DENTRY_CACHE_SIZE 256
+
 /* A directory. */
 struct dir {
     struct inode *inode;                /* Backing store. */
@@ -19,6 +41,158 @@ struct dir_entry {
     bool in_use;                        /* In use or free? */
 };
 
+/* Entry 0 of a directory, in place of a struct dir_entry.
+
+   A large directory also has a hash index, a separate file of
+   struct index_slot that maps the hash of each name to the number
+   of its entry, so that lookup, dir_add() and dir_remove() read a
+   sector or two of the index and one entry instead of scanning
+   the whole directory.  Its free entries are then chained through
+   their inode_sector fields from FREE_HEAD.  Directories without
+   an index, including those written before indexes existed, whose
+   header held only PARENT, keep being scanned linearly. */
+struct dir_header {
+    block_sector_t parent;              /* Parent directory's inode. */
+    block_sector_t index;               /* Hash index inode. */
+    uint32_t magic;                     /* DIR_INDEX_MAGIC if INDEX is valid. */
+    uint32_t free_head;                 /* First free entry, or 0. */
+    uint32_t unused;
+};
+
+/* First bytes of a hash index, in place of slot 0. */
+struct index_header {
+    uint32_t slot_cnt;                  /* Slots, a power of 2. */
+    uint32_t used;                      /* Slots not empty, deleted included. */
+};
+
+/* One slot of a hash index.  Slots are numbered from 1, after the
+   index_header, and probed linearly. */
+struct index_slot {
+    uint32_t hash;                      /* hash_string() of the name. */
+    uint32_t entry;                     /* Entry number, 0 if empty,
+                                           SLOT_DELETED if removed. */
+};
+
+/* A remembered result of looking up NAME in the directory whose
+   inode is in PARENT: the inode sector it names, or 0 if there
+   is no such file.  Sector 0 holds the free map, so it is never
+   a file's inode. */
+struct dentry {
+    struct hash_elem hash_elem;         /* Element in dentries. */
+    struct list_elem lru_elem;          /* Element in dentry_lru. */
+    block_sector_t parent;              /* Directory looked in. */
+    char name[NAME_MAX + 1];            /* Name looked up. */
+    block_sector_t inode_sector;        /* Result, 0 if negative. */
+};
+
+/* Cache of name lookups, so that resolving the same path again
+   costs a hash lookup per component instead of a directory
+   search.  dir_add() and dir_remove() keep it current, and
+   removing a directory forgets every name looked up in it, since
+   its sector may be reused.  dentry_lock protects the table and
+   the LRU list, most recently used first; a hit only stays true
+   while the directory's inode_lock_dir() is held. */
+static struct hash dentries;
+static struct list dentry_lru;
+static struct lock dentry_lock;
+
+static unsigned dentry_hash(const struct hash_elem *e, void *aux UNUSED) {
+    const struct dentry *d = hash_entry(e, struct dentry, hash_elem);
+    return hash_string(d->name) ^ hash_int((int) d->parent);
+}
+
+static bool dentry_less(const struct hash_elem *a_, const struct hash_elem *b_, void *aux UNUSED) {
+    const struct dentry *a = hash_entry(a_, struct dentry, hash_elem);
+    const struct dentry *b = hash_entry(b_, struct dentry, hash_elem);
+    return a->parent != b->parent ? a->parent < b->parent : strcmp(a->name, b->name) < 0;
+}
+
+/* Initializes the directory module. */
+void dir_init(void) {
+    if (!hash_init(&dentries, dentry_hash, dentry_less, NULL))
+        PANIC("dentry cache creation failed");
+    list_init(&dentry_lru);
+    lock_init(&dentry_lock);
+}
+
+/* Returns the cached lookup of NAME in PARENT, or a null pointer.
+   dentry_lock must be held. */
+static struct dentry *find_dentry(block_sector_t parent, const char *name) {
+    ASSERT(lock_held_by_current_thread(&dentry_lock));
+
+    struct dentry key;
+    key.parent = parent;
+    strlcpy(key.name, name, sizeof key.name);
+    struct hash_elem *e = hash_find(&dentries, &key.hash_elem);
+    return e != NULL ? hash_entry(e, struct dentry, hash_elem) : NULL;
+}
+
+/* Forgets D.  dentry_lock must be held. */
+static void drop_dentry(struct dentry *d) {
+    hash_delete(&dentries, &d->hash_elem);
+    list_remove(&d->lru_elem);
+    free(d);
+}
+
+/* Looks NAME in PARENT up in the dentry cache.  On a hit returns
+   true and sets *SECTOR to the inode sector found, or to 0 if the
+   name is known not to exist. */
+static bool dentry_lookup(block_sector_t parent, const char *name, block_sector_t *sector) {
+    lock_acquire(&dentry_lock);
+    struct dentry *d = find_dentry(parent, name);
+    if (d != NULL) {
+        list_remove(&d->lru_elem);
+        list_push_front(&dentry_lru, &d->lru_elem);
+        *sector = d->inode_sector;
+    }
+    lock_release(&dentry_lock);
+    return d != NULL;
+}
+
+/* Remembers that NAME in PARENT names the inode in SECTOR, or
+   nothing if SECTOR is 0. */
+static void dentry_insert(block_sector_t parent, const char *name, block_sector_t sector) {
+    if (strlen(name) > NAME_MAX)
+        return;
+
+    lock_acquire(&dentry_lock);
+    struct dentry *d = find_dentry(parent, name);
+    if (d == NULL) {
+        if (hash_size(&dentries) >= DENTRY_CACHE_SIZE)
+            drop_dentry(list_entry(list_back(&dentry_lru), struct dentry, lru_elem));
+        d = malloc(sizeof *d);
+        if (d != NULL) {
+            d->parent = parent;
+            strlcpy(d->name, name, sizeof d->name);
+            hash_insert(&dentries, &d->hash_elem);
+            list_push_front(&dentry_lru, &d->lru_elem);
+        }
+    }
+    if (d != NULL)
+        d->inode_sector = sector;
+    lock_release(&dentry_lock);
+}
+
+/* Forgets NAME in PARENT, or every name in PARENT if NAME is a
+   null pointer. */
+static void dentry_forget(block_sector_t parent, const char *name) {
+    lock_acquire(&dentry_lock);
+    if (name != NULL) {
+        struct dentry *d = find_dentry(parent, name);
+        if (d != NULL)
+            drop_dentry(d);
+    } else {
+        struct list_elem *e = list_begin(&dentry_lru);
+        while (e != list_end(&dentry_lru)) {
+            struct dentry *d = list_entry(e, struct dentry, lru_elem);
+            e = list_next(e);
+            if (d->parent == parent)
+                drop_dentry(d);
+        }
+    }
+    lock_release(&dentry_lock);
+}
+
 bool parse_pathname(char *path, char *directory, char *filename) {
     int len = strlen(path) + 1;
     if (len <= 1) {
@@ -54,6 +228,8 @@ bool parse_pathname(char *path, char *directory, char *filename) {
 /* Creates a directory with space for ENTRY_CNT entries in the
    given SECTOR.  Returns true if successful, false on failure. */
 bool dir_create(block_sector_t sector, size_t entry_cnt) {
+    ASSERT(sizeof(struct dir_header) == sizeof(struct dir_entry));
+
     bool success = inode_create(sector, entry_cnt * sizeof(struct dir_entry), DIRECTORY);
     if (!success) {
         return success;
@@ -61,9 +237,10 @@ bool dir_create(block_sector_t sector, size_t entry_cnt) {
 
     struct dir *dir = dir_open(inode_open(sector));
     ASSERT(dir);
-    struct dir_entry entry;
-    entry.inode_sector = sector;
-    if (inode_write_at(dir->inode, &entry, sizeof entry, 0) != sizeof entry) {
+    struct dir_header header;
+    memset(&header, 0, sizeof header);
+    header.parent = sector;
+    if (inode_write_at(dir->inode, &header, sizeof header, 0) != sizeof header) {
         success = false;
     }
     dir_close(dir);
@@ -151,6 +328,8 @@ struct inode *dir_get_inode(struct dir *dir) {
     return dir->inode;
 }
 
+/* Returns true if DIR has no entries.  The caller must hold
+   DIR's inode_lock_dir() for the answer to stay true. */
 bool dir_is_empty(const struct dir *dir) {
     struct dir_entry entry;
     for (int ofs = sizeof(entry); inode_read_at(dir->inode, &entry, sizeof(entry), ofs) == sizeof(entry); ofs += sizeof(entry)) {
@@ -161,19 +340,207 @@ bool dir_is_empty(const struct dir *dir) {
     return true;
 }
 
+/* Reads the header of DIR into *HEADER. */
+static void read_header(const struct dir *dir, struct dir_header *header) {
+    if (inode_read_at(dir->inode, header, sizeof *header, 0) != sizeof *header)
+        memset(header, 0, sizeof *header);
+}
+
+/* Writes HEADER as the header of DIR. */
+static bool write_header(struct dir *dir, const struct dir_header *header) {
+    return inode_write_at(dir->inode, header, sizeof *header, 0) == sizeof *header;
+}
+
+/* Returns the byte offset of the slot that the Nth probe for a
+   name hashing to N - 1 looks at in an index of SLOT_CNT slots. */
+static off_t slot_ofs(uint32_t n, uint32_t slot_cnt) {
+    return (1 + (n & (slot_cnt - 1))) * sizeof(struct index_slot);
+}
+
+/* Opens the hash index described by HEADER, or returns a null
+   pointer if there is none.  The caller must close it. */
+static struct inode *open_index(const struct dir_header *header) {
+    return header->magic == DIR_INDEX_MAGIC ? inode_open(header->index) : NULL;
+}
+
+/* Searches INDEX, the hash index of DIR, like lookup(). */
+static bool index_lookup(struct inode *index, const struct dir *dir, const char *name,
+                         struct dir_entry *ep, off_t *ofsp) {
+    struct index_header ih;
+    uint32_t hash = hash_string(name);
+
+    if (inode_read_at(index, &ih, sizeof ih, 0) != sizeof ih)
+        return false;
+    for (uint32_t i = 0; i < ih.slot_cnt; i++) {
+        struct index_slot slot;
+        if (inode_read_at(index, &slot, sizeof slot, slot_ofs(hash + i, ih.slot_cnt)) != sizeof slot
+            || slot.entry == 0)
+            return false;
+        if (slot.entry == SLOT_DELETED || slot.hash != hash)
+            continue;
+
+        struct dir_entry e;
+        off_t ofs = slot.entry * sizeof e;
+        if (inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e
+            && e.in_use && !strcmp(name, e.name)) {
+            if (ep != NULL)
+                *ep = e;
+            if (ofsp != NULL)
+                *ofsp = ofs;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Adds entry number ENTRY, whose name hashes to HASH, to INDEX.
+   Returns false if INDEX is too full, in which case it should be
+   rebuilt larger. */
+static bool index_insert(struct inode *index, uint32_t hash, uint32_t entry) {
+    struct index_header ih;
+
+    if (inode_read_at(index, &ih, sizeof ih, 0) != sizeof ih
+        || (ih.used + 1) * 2 > ih.slot_cnt)
+        return false;
+    for (uint32_t i = 0; i < ih.slot_cnt; i++) {
+        struct index_slot slot;
+        off_t ofs = slot_ofs(hash + i, ih.slot_cnt);
+        if (inode_read_at(index, &slot, sizeof slot, ofs) != sizeof slot)
+            return false;
+        if (slot.entry != 0 && slot.entry != SLOT_DELETED)
+            continue;
+
+        if (slot.entry == 0) {
+            ih.used++;
+            if (inode_write_at(index, &ih, sizeof ih, 0) != sizeof ih)
+                return false;
+        }
+        slot.hash = hash;
+        slot.entry = entry;
+        return inode_write_at(index, &slot, sizeof slot, ofs) == sizeof slot;
+    }
+    return false;
+}
+
+/* Marks the slot of entry number ENTRY, whose name hashes to
+   HASH, deleted in INDEX. */
+static void index_delete(struct inode *index, uint32_t hash, uint32_t entry) {
+    struct index_header ih;
+
+    if (inode_read_at(index, &ih, sizeof ih, 0) != sizeof ih)
+        return;
+    for (uint32_t i = 0; i < ih.slot_cnt; i++) {
+        struct index_slot slot;
+        off_t ofs = slot_ofs(hash + i, ih.slot_cnt);
+        if (inode_read_at(index, &slot, sizeof slot, ofs) != sizeof slot || slot.entry == 0)
+            return;
+        if (slot.entry == entry) {
+            slot.entry = SLOT_DELETED;
+            inode_write_at(index, &slot, sizeof slot, ofs);
+            return;
+        }
+    }
+}
+
+/* Builds a new hash index for DIR, whose header is *HEADER, from
+   scratch, chains its free entries, and replaces the old index,
+   if any.  Updates *HEADER and writes it back.  On failure DIR
+   keeps its old index, or none, either of which still works. */
+static bool build_index(struct dir *dir, struct dir_header *header) {
+    struct dir_entry e;
+    uint32_t live = 0;
+    off_t ofs;
+
+    for (ofs = sizeof e; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e; ofs += sizeof e) {
+        if (e.in_use)
+            live++;
+    }
+
+    uint32_t slot_cnt = DIR_INDEX_MIN_SLOTS;
+    while (slot_cnt < live * DIR_INDEX_SLOTS_PER_ENTRY)
+        slot_cnt *= 2;
+    size_t size = (slot_cnt + 1) * sizeof(struct index_slot);
+    struct index_slot *slots = calloc(1, size);
+    if (slots == NULL)
+        return false;
+    struct index_header *ih = (struct index_header *) slots;
+    ih->slot_cnt = slot_cnt;
+    ih->used = live;
+
+    /* Fill in the slots, and chain the free entries, last first so
+       that the lowest entries are reused first. */
+    uint32_t free_head = 0;
+    uint32_t entry_cnt = ofs / sizeof e;
+    for (uint32_t entry = entry_cnt - 1; entry > 0; entry--) {
+        if (inode_read_at(dir->inode, &e, sizeof e, entry * sizeof e) != sizeof e)
+            continue;
+        if (e.in_use) {
+            uint32_t hash = hash_string(e.name);
+            uint32_t i = 0;
+            while (slots[slot_ofs(hash + i, slot_cnt) / sizeof *slots].entry != 0)
+                i++;
+            slots[slot_ofs(hash + i, slot_cnt) / sizeof *slots].hash = hash;
+            slots[slot_ofs(hash + i, slot_cnt) / sizeof *slots].entry = entry;
+        } else {
+            e.inode_sector = free_head;
+            if (inode_write_at(dir->inode, &e, sizeof e, entry * sizeof e) == sizeof e)
+                free_head = entry;
+        }
+    }
+
+    /* Write it out next to the directory. */
+    block_sector_t sector = 0;
+    struct inode *index = NULL;
+    bool success = (free_map_allocate_near(inode_get_inumber(dir->inode), 1, &sector)
+                    && inode_create(sector, 0, DIRECTORY_INDEX)
+                    && (index = inode_open(sector)) != NULL
+                    && inode_write_at(index, slots, size, 0) == (off_t) size);
+    free(slots);
+    if (!success) {
+        if (index != NULL)
+            inode_remove(index);
+        else if (sector != 0)
+            free_map_release(sector, 1);
+        inode_close(index);
+        return false;
+    }
+    inode_close(index);
+
+    struct inode *old = open_index(header);
+    header->index = sector;
+    header->magic = DIR_INDEX_MAGIC;
+    header->free_head = free_head;
+    write_header(dir, header);
+    if (old != NULL) {
+        inode_remove(old);
+        inode_close(old);
+    }
+    return true;
+}
+
 /* Searches DIR for a file with the given NAME.
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   otherwise, returns false and ignores EP and OFSP.
+   The caller must hold DIR's inode_lock_dir(). */
 static bool lookup(const struct dir *dir, const char *name,
                    struct dir_entry *ep, off_t *ofsp) {
     struct dir_entry e;
+    struct dir_header header;
     size_t ofs;
 
     ASSERT(dir != NULL);
     ASSERT(name != NULL);
 
+    read_header(dir, &header);
+    struct inode *index = open_index(&header);
+    if (index != NULL) {
+        bool found = index_lookup(index, dir, name, ep, ofsp);
+        inode_close(index);
+        return found;
+    }
+
     //start after parent directory
     for (ofs = sizeof(e); inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e; ofs += sizeof e) {
         if (e.in_use && !strcmp(name, e.name)) {
@@ -194,19 +561,32 @@ static bool lookup(const struct dir *dir, const char *name,
 bool dir_lookup(const struct dir *dir, const char *name,
                 struct inode **inode) {
     struct dir_entry e;
+    block_sector_t sector;
 
     ASSERT(dir != NULL);
     ASSERT(name != NULL);
 
+    block_sector_t parent = inode_get_inumber(dir->inode);
     if (strcmp(name, ".") == 0) {
         *inode = inode_reopen(dir->inode);
     } else if (strcmp(name, "..") == 0) {
-        inode_read_at(dir->inode, &e, sizeof(e), 0);
-        *inode = inode_open(e.inode_sector);
-    } else if (lookup(dir, name, &e, NULL)) {
-        *inode = inode_open(e.inode_sector);
+        struct dir_header header;
+        read_header(dir, &header);
+        *inode = inode_open(header.parent);
     } else {
-        *inode = NULL;
+        /* Open the inode with the directory locked, so that it
+           cannot be removed and its sector reused in between. */
+        inode_lock_dir(dir->inode);
+        if (dentry_lookup(parent, name, &sector)) {
+            *inode = sector != 0 ? inode_open(sector) : NULL;
+        } else if (lookup(dir, name, &e, NULL)) {
+            dentry_insert(parent, name, e.inode_sector);
+            *inode = inode_open(e.inode_sector);
+        } else {
+            dentry_insert(parent, name, 0);
+            *inode = NULL;
+        }
+        inode_unlock_dir(dir->inode);
     }
 
     return *inode != NULL;
@@ -220,6 +600,8 @@ bool dir_lookup(const struct dir *dir, const char *name,
    error occurs. */
 bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector, InodeType type) {
     struct dir_entry e;
+    struct dir_header header;
+    struct inode *index = NULL;
     off_t ofs;
     bool success = false;
 
@@ -231,8 +613,10 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector, Ino
         return false;
     }
 
-    /* Check that NAME is not in use. */
-    if (lookup(dir, name, NULL, NULL)){
+    /* Check that NAME is not in use, and that DIR was not removed
+       since it was opened. */
+    inode_lock_dir(dir->inode);
+    if (is_removed(dir->inode) || lookup(dir, name, NULL, NULL)){
         goto done;
     }
 
@@ -241,33 +625,61 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector, Ino
         struct dir *child = dir_open(inode_open(inode_sector));
         if (!child)
             goto done;
-        e.inode_sector = inode_get_inumber(dir_get_inode(dir));
-        if (inode_write_at(child->inode, &e, sizeof(e), 0) != sizeof(e)) {
+        block_sector_t parent = inode_get_inumber(dir_get_inode(dir));
+        if (inode_write_at(child->inode, &parent, sizeof parent, 0) != sizeof parent) {
             dir_close(child);
             goto done;
         }
         dir_close(child);
     }
 
-    /* Set OFS to offset of free slot.
-       If there are no free slots, then it will be set to the
-       current end-of-file.
-
-       inode_read_at() will only return a short read at end of file.
-       Otherwise, we'd need to verify that we didn't get a short
-       read due to something intermittent such as low memory. */
-    for (ofs = sizeof(e); inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
-         ofs += sizeof e)
-        if (!e.in_use)
-            break;
+    read_header(dir, &header);
+    index = open_index(&header);
+    if (index != NULL) {
+        /* Take the first free slot off the free chain, or append. */
+        ofs = header.free_head != 0 ? (off_t) (header.free_head * sizeof e) : inode_length(dir->inode);
+        if (header.free_head != 0) {
+            if (inode_read_at(dir->inode, &e, sizeof e, ofs) != sizeof e)
+                goto done;
+            header.free_head = e.inode_sector;
+        }
+    } else {
+        /* Set OFS to offset of free slot.
+           If there are no free slots, then it will be set to the
+           current end-of-file.
+
+           inode_read_at() will only return a short read at end of file.
+           Otherwise, we'd need to verify that we didn't get a short
+           read due to something intermittent such as low memory. */
+        for (ofs = sizeof(e); inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+             ofs += sizeof e)
+            if (!e.in_use)
+                break;
+    }
 
     /* Write slot. */
     e.in_use = true;
     strlcpy(e.name, name, sizeof e.name);
     e.inode_sector = inode_sector;
     success = inode_write_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+    if (!success)
+        goto done;
+    dentry_forget(inode_get_inumber(dir->inode), name);
+
+    /* Index it, building a bigger index when the old one fills up
+       and a first one once the directory is large.  A directory
+       whose index cannot be built stays linear. */
+    if (index != NULL) {
+        write_header(dir, &header);
+        if (!index_insert(index, hash_string(name), ofs / sizeof e))
+            build_index(dir, &header);
+    } else if (ofs / sizeof e >= DIR_INDEX_MIN_ENTRIES) {
+        build_index(dir, &header);
+    }
 
     done:
+    inode_close(index);
+    inode_unlock_dir(dir->inode);
     return success;
 }
 
@@ -277,12 +689,15 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector, Ino
 bool dir_remove(struct dir *dir, const char *name) {
     struct dir_entry e;
     struct inode *inode = NULL;
+    bool child_locked = false;
     bool success = false;
     off_t ofs;
 
     ASSERT(dir != NULL);
     ASSERT(name != NULL);
 
+    inode_lock_dir(dir->inode);
+
     /* Find directory entry. */
     if (!lookup(dir, name, &e, &ofs))
         goto done;
@@ -292,24 +707,62 @@ bool dir_remove(struct dir *dir, const char *name) {
     if (inode == NULL)
         goto done;
 
+    /* A directory must be empty, and stay empty: its own lock
+       keeps dir_add() out until it is marked removed. */
     if (is_directory(inode)) {
-        struct dir *to_remove = dir_open(inode);
+        inode_lock_dir(inode);
+        child_locked = true;
+        struct dir *to_remove = dir_open(inode_reopen(inode));
         bool is_emtpy = dir_is_empty(to_remove);
         dir_close(to_remove);
         if (!is_emtpy)
             goto done;
     }
 
-    /* Erase directory entry. */
+    /* Erase directory entry, chaining it onto the free entries if
+       DIR has an index. */
+    struct dir_header header;
+    read_header(dir, &header);
+    struct inode *index = open_index(&header);
     e.in_use = false;
-    if (inode_write_at(dir->inode, &e, sizeof e, ofs) != sizeof e)
+    if (index != NULL)
+        e.inode_sector = header.free_head;
+    if (inode_write_at(dir->inode, &e, sizeof e, ofs) != sizeof e) {
+        inode_close(index);
         goto done;
+    }
+    dentry_forget(inode_get_inumber(dir->inode), name);
+    if (index != NULL) {
+        index_delete(index, hash_string(name), ofs / sizeof e);
+        header.free_head = ofs / sizeof e;
+        write_header(dir, &header);
+        inode_close(index);
+    }
+
+    /* A removed directory takes its index and cached names along. */
+    if (is_directory(inode)) {
+        dentry_forget(inode_get_inumber(inode), NULL);
+        struct dir *removed = dir_open(inode_reopen(inode));
+        if (removed != NULL) {
+            struct dir_header removed_header;
+            read_header(removed, &removed_header);
+            struct inode *removed_index = open_index(&removed_header);
+            if (removed_index != NULL) {
+                inode_remove(removed_index);
+                inode_close(removed_index);
+            }
+            dir_close(removed);
+        }
+    }
 
     /* Remove inode. */
     inode_remove(inode);
     success = true;
 
     done:
+    if (child_locked)
+        inode_unlock_dir(inode);
+    inode_unlock_dir(dir->inode);
     inode_close(inode);
     return success;
 }
@@ -319,13 +772,48 @@ bool dir_remove(struct dir *dir, const char *name) {
    contains no more entries. */
 bool dir_readdir(struct dir *dir, char name[NAME_MAX + 1]) {
     struct dir_entry e;
+    bool found = false;
 
-    while (inode_read_at(dir->inode, &e, sizeof e, dir->pos) == sizeof e) {
+    inode_lock_dir(dir->inode);
+    while (!found && inode_read_at(dir->inode, &e, sizeof e, dir->pos) == sizeof e) {
         dir->pos += sizeof e;
         if (e.in_use) {
             strlcpy(name, e.name, NAME_MAX + 1);
-            return true;
+            found = true;
         }
     }
-    return false;
+    inode_unlock_dir(dir->inode);
+    return found;
+}
+
+/* Reads up to CNT of the next entries in DIR into ENTRIES, a
+   sector's worth of directory entries at a time.  Returns the
+   number read, which is 0 once DIR contains no more entries. */
+size_t dir_read_entries(struct dir *dir, struct dirent *entries, size_t cnt) {
+    struct dir_entry batch[BLOCK_SECTOR_SIZE / sizeof(struct dir_entry)];
+    size_t n = 0;
+
+    inode_lock_dir(dir->inode);
+    while (n < cnt) {
+        off_t size = inode_read_at(dir->inode, batch, sizeof batch, dir->pos);
+        int batch_cnt = size / sizeof *batch;
+        if (batch_cnt == 0)
+            break;
+
+        int i;
+        for (i = 0; i < batch_cnt && n < cnt; i++) {
+            if (!batch[i].in_use)
+                continue;
+
+            struct dirent *d = &entries[n++];
+            struct inode *inode = inode_open(batch[i].inode_sector);
+            d->inumber = batch[i].inode_sector;
+            d->is_dir = inode != NULL && is_directory(inode);
+            strlcpy(d->name, batch[i].name, sizeof d->name);
+            inode_close(inode);
+        }
+        dir->pos += i * sizeof *batch;
+    }
+    inode_unlock_dir(dir->inode);
+    return n;
 }
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <dirent.h>
 #include "devices/block.h"
 #include "../filesys/inode.h"
 
@@ -14,6 +15,8 @@
 
 struct inode;
 
+void dir_init(void);
+
 /* Opening and closing directories. */
 bool dir_create(block_sector_t sector, size_t entry_cnt);
 
@@ -36,6 +39,8 @@ bool dir_remove(struct dir *, const char *name);
 
 bool dir_readdir(struct dir *, char name[NAME_MAX + 1]);
 
+size_t dir_read_entries(struct dir *, struct dirent *, size_t cnt);
+
 bool parse_pathname(char *path, char *directory, char *filename);
 
 void split_path_filename(const char *path, char *directory, char *filename);
@@ -113,6 +113,26 @@ file_write_at (struct file *file, const void *buffer, off_t size,
   return inode_write_at (file->inode, buffer, size, file_ofs);
 }
 
+/* Copies SIZE bytes from IN, starting at its current position,
+   into OUT at its current position, without passing them through
+   a caller's buffer.
+   Returns the number of bytes actually copied,
+   which may be less than SIZE if end of IN is reached,
+   or -1 if nothing could be copied, see inode_copy_at().
+   Advances both positions by the number of bytes copied. */
+off_t
+file_copy (struct file *in, struct file *out, off_t size)
+{
+  off_t bytes_copied = inode_copy_at (in->inode, in->pos,
+                                      out->inode, out->pos, size);
+  if (bytes_copied > 0)
+    {
+      in->pos += bytes_copied;
+      out->pos += bytes_copied;
+    }
+  return bytes_copied;
+}
+
 /* Prevents write operations on FILE's underlying inode
    until file_allow_write() is called or FILE is closed. */
 void
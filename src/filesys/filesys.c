@@ -4,6 +4,7 @@
 #include <string.h>
 #include "filesys/file.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "../filesys/cache.h"
@@ -22,6 +23,7 @@ void filesys_init(bool format) {
         PANIC("No file system device found, can't initialize file system.");
 
     inode_init();
+    dir_init();
     free_map_init();
 
     init_buffer_cache();
@@ -29,12 +31,15 @@ void filesys_init(bool format) {
     if (format)
         do_format();
 
+    journal_open();
     free_map_open();
 }
 
 /* Shuts down the file system module, writing any unwritten data
    to disk. */
 void filesys_done(void) {
+    inode_flush_delayed();
+    journal_close();
     free_map_close();
 
     flush_buffer_cache();
@@ -49,14 +54,16 @@ bool filesys_create(const char *name, off_t initial_size, InodeType type) {
     char directory[strlen(name)];
     char file_name[strlen(name)];
     parse_pathname(name, directory, file_name);
+    journal_begin();
     struct dir *dir = dir_open_path(directory);
     bool success = (dir != NULL
-                    && free_map_allocate(1, &inode_sector)
+                    && free_map_allocate_near(inode_get_inumber(dir_get_inode(dir)), 1, &inode_sector)
                     && inode_create(inode_sector, initial_size, type)
                     && dir_add(dir, file_name, inode_sector, type));
     if (!success && inode_sector != 0)
         free_map_release(inode_sector, 1);
     dir_close(dir);
+    journal_end();
 
     return success;
 }
@@ -102,13 +109,23 @@ bool filesys_remove(const char *name) {
     char directory[strlen(name)];
     char file_name[strlen(name)];
     parse_pathname(name, directory, file_name);
+    journal_begin();
     struct dir *dir = dir_open_path(directory);
     bool success = dir != NULL && dir_remove(dir, file_name);
     dir_close(dir);
+    journal_end();
 
     return success;
 }
 
+/* Commits every metadata change and writes every dirty cached
+   sector to disk, allocating delayed appends first. */
+void filesys_sync(void) {
+    inode_flush_delayed();
+    journal_commit();
+    flush_buffer_cache();
+}
+
 bool filesys_chdir(const char *dir_name) {
     struct dir *dir = dir_open_path(dir_name);
 
@@ -125,6 +142,7 @@ bool filesys_chdir(const char *dir_name) {
 static void do_format(void) {
     printf("Formatting file system...");
     free_map_create();
+    journal_create();
     if (!dir_create(ROOT_DIR_SECTOR, 16))
         PANIC("root directory creation failed");
     free_map_close();
@@ -8,6 +8,7 @@
 /* Sectors of system file inodes. */
 #define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
 #define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
+#define JOURNAL_SECTOR 2        /* Journal superblock sector. */
 
 /* Block device that contains the file system. */
 struct block *fs_device;
@@ -22,6 +23,8 @@ struct file *filesys_open(const char *name);
 
 bool filesys_remove(const char *name);
 
+void filesys_sync(void);
+
 bool filesys_chdir(const char *dir_name);
 
 #endif /* filesys/filesys.h */
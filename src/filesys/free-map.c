@@ -1,12 +1,164 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
+/* Sectors of the free map covered by one sector of its file. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * 8)
+
+/* The disk is divided into regions of REGION_SECTORS sectors,
+   much like FFS cylinder groups, each with a count of its free
+   sectors.  An allocation searches outward from a goal sector
+   region by region, skipping regions too full to help without
+   scanning their bits, so that a file's sectors end up next to
+   each other and close to its directory. */
+#define REGION_SECTORS BITS_PER_SECTOR
+
+/* Changes to the free map reach its file only at sync points:
+   free_map_flush(), which every journal commit calls, and
+   free_map_close().  In between, free_map_dirty records which
+   sectors of the file are stale, so that allocating a run of
+   sectors rewrites only the one or two sectors of the file
+   covering it, once, instead of the whole file on every call.
+
+   This costs nothing in crash safety.  Flushing the free map
+   inside each commit puts its changes in the same journal group
+   as the inodes that use the sectors it allocates, so the two
+   never disagree after a crash. */
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct bitmap *free_map_dirty; /* Stale sectors of free_map_file. */
+static size_t region_cnt;            /* Number of regions. */
+static size_t *region_free;          /* Free sectors in each region. */
+static struct lock free_map_lock;    /* Protects everything above. */
+
+/* Records that the free map bits of the CNT sectors starting at
+   SECTOR changed.  free_map_lock must be held. */
+static void
+mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / BITS_PER_SECTOR;
+  size_t last = (sector + cnt - 1) / BITS_PER_SECTOR;
+
+  ASSERT (lock_held_by_current_thread (&free_map_lock));
+  if (cnt > 0)
+    bitmap_set_multiple (free_map_dirty, first, last - first + 1, true);
+}
+
+/* Marks the CNT sectors starting at SECTOR, which must all be
+   free, as used if USED is true, and the reverse if USED is
+   false.  free_map_lock must be held. */
+static void
+set_used (block_sector_t sector, size_t cnt, bool used)
+{
+  size_t end = sector + cnt;
+  size_t i;
+
+  ASSERT (!bitmap_contains (free_map, sector, cnt, used));
+  bitmap_set_multiple (free_map, sector, cnt, used);
+  mark_dirty (sector, cnt);
+  for (i = sector; i < end; )
+    {
+      size_t region = i / REGION_SECTORS;
+      size_t next = (region + 1) * REGION_SECTORS;
+      size_t n = (next < end ? next : end) - i;
+
+      if (used)
+        region_free[region] -= n;
+      else
+        region_free[region] += n;
+      i += n;
+    }
+}
+
+/* Recounts the free sectors in each region. */
+static void
+count_free (void)
+{
+  size_t r;
+
+  for (r = 0; r < region_cnt; r++)
+    {
+      size_t start = r * REGION_SECTORS;
+      size_t cnt = bitmap_size (free_map) - start;
+
+      if (cnt > REGION_SECTORS)
+        cnt = REGION_SECTORS;
+      region_free[r] = bitmap_count (free_map, start, cnt, false);
+    }
+}
+
+/* Returns the first of CNT free sectors in a row that lie
+   between START and END, or BITMAP_ERROR if there are none. */
+static size_t
+scan_range (size_t start, size_t end, size_t cnt)
+{
+  size_t run = 0;
+  size_t i;
+
+  for (i = start; i < end; i++)
+    if (bitmap_test (free_map, i))
+      run = 0;
+    else if (++run == cnt)
+      return i + 1 - cnt;
+  return BITMAP_ERROR;
+}
+
+/* Returns the first of CNT free sectors in a row within REGION,
+   looking first at GOAL and after if GOAL lies in REGION, or
+   BITMAP_ERROR if there are none. */
+static size_t
+scan_region (size_t region, size_t goal, size_t cnt)
+{
+  size_t start = region * REGION_SECTORS;
+  size_t end = start + REGION_SECTORS;
+  size_t idx;
+
+  if (region_free[region] < cnt)
+    return BITMAP_ERROR;
+  if (end > bitmap_size (free_map))
+    end = bitmap_size (free_map);
+  if (goal <= start || goal >= end)
+    return scan_range (start, end, cnt);
+
+  idx = scan_range (goal, end, cnt);
+  if (idx == BITMAP_ERROR)
+    idx = scan_range (start, goal + cnt - 1 < end ? goal + cnt - 1 : end,
+                      cnt);
+  return idx;
+}
+
+/* Returns the first of CNT free sectors in a row closest to GOAL
+   by region, or BITMAP_ERROR if there are none.
+   free_map_lock must be held. */
+static size_t
+find_free (block_sector_t goal, size_t cnt)
+{
+  size_t home, d, idx;
+
+  if (goal >= bitmap_size (free_map))
+    goal = 0;
+  home = goal / REGION_SECTORS;
+  for (d = 0; home + d < region_cnt || d <= home; d++)
+    {
+      if (home + d < region_cnt
+          && (idx = scan_region (home + d, goal, cnt)) != BITMAP_ERROR)
+        return idx;
+      if (d > 0 && d <= home
+          && (idx = scan_region (home - d, goal, cnt)) != BITMAP_ERROR)
+        return idx;
+    }
+
+  /* A run too long for one region, or one that fits only across
+     a region boundary. */
+  return bitmap_scan (free_map, 0, cnt, false);
+}
 
 /* Initializes the free map. */
 void
@@ -15,38 +167,106 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  free_map_dirty = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                                BLOCK_SECTOR_SIZE));
+  if (free_map_dirty == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  region_cnt = DIV_ROUND_UP (bitmap_size (free_map), REGION_SECTORS);
+  region_free = malloc (region_cnt * sizeof *region_free);
+  if (region_free == NULL)
+    PANIC ("region table creation failed--file system device is too large");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  bitmap_mark (free_map, JOURNAL_SECTOR);
+  count_free ();
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
    the first into *SECTORP.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  return free_map_allocate_near (0, cnt, sectorp);
+}
+
+/* Allocates CNT consecutive sectors from the free map, as close
+   to GOAL as possible, and stores the first into *SECTORP.  GOAL
+   is typically the sector after the last one of the file being
+   grown, or the inode of the directory a new file goes into.
+   Returns true if successful, false if not enough consecutive
+   sectors were available. */
+bool
+free_map_allocate_near (block_sector_t goal, size_t cnt,
+                        block_sector_t *sectorp)
+{
+  lock_acquire (&free_map_lock);
+  block_sector_t sector = find_free (goal, cnt);
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      set_used (sector, cnt, true);
+      *sectorp = sector;
     }
-  if (sector != BITMAP_ERROR)
-    *sectorp = sector;
+  lock_release (&free_map_lock);
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Allocates up to CNT sectors starting exactly at SECTOR, as
+   many as are free before the first one in use, so that a run of
+   sectors can grow in place.
+   Returns the number of sectors allocated, which is 0 if SECTOR
+   itself is in use. */
+size_t
+free_map_extend (block_sector_t sector, size_t cnt)
+{
+  size_t n = 0;
+
+  lock_acquire (&free_map_lock);
+  while (n < cnt && sector + n < bitmap_size (free_map)
+         && !bitmap_test (free_map, sector + n))
+    n++;
+  if (n > 0)
+    set_used (sector, n, true);
+  lock_release (&free_map_lock);
+  return n;
+}
+
+/* Makes CNT sectors starting at SECTOR available for use.  A
+   sector the journal could still replay stays in use until its
+   next checkpoint. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
-  ASSERT (bitmap_all (free_map, sector, cnt));
-  bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  size_t i;
+
+  lock_acquire (&free_map_lock);
+  for (i = 0; i < cnt; i++)
+    if (!journal_defer_free (sector + i))
+      set_used (sector + i, 1, false);
+  lock_release (&free_map_lock);
+}
+
+/* Writes the sectors of the free map file that changed since the
+   last flush into the buffer cache, as one journal transaction.
+   A sector that cannot be written stays dirty for the next
+   flush. */
+void
+free_map_flush (void)
+{
+  size_t i;
+
+  journal_begin ();
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    for (i = 0; i < bitmap_size (free_map_dirty); i++)
+      if (bitmap_test (free_map_dirty, i)
+          && bitmap_write_range (free_map, free_map_file,
+                                 i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+        bitmap_reset (free_map_dirty, i);
+  lock_release (&free_map_lock);
+  journal_end ();
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +278,19 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  bitmap_set_all (free_map_dirty, false);
+  count_free ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  free_map_flush ();
+  lock_acquire (&free_map_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -82,4 +308,5 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (free_map_dirty, false);
 }
@@ -1,11 +1,13 @@
 #include "../filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 #include "../filesys/cache.h"
 
 /* Identifies an inode. */
@@ -15,13 +17,58 @@
 #define INDIRECT_BLOCKS_PER_SECTOR 128
 #define MAX_DEPTH 2
 
+#define EXTENTS_COUNT 62
+
+/* Sectors of appended data a file may hold in memory before they
+   are allocated, see struct delayed_tail. */
+#define DELAYED_SECTORS 64
+
+/* Bytes of data an inode can hold itself, the size of the map
+   they replace. */
+#define INLINE_DATA_SIZE ((DIRECT_BLOCKS_COUNT + 2) * sizeof (block_sector_t))
+
+/* How an inode_disk maps file sectors to disk sectors. */
+enum inode_layout {
+    LAYOUT_BLOCK_MAP,   // direct, indirect and doubly indirect blocks
+    LAYOUT_EXTENTS,     // runs of consecutive sectors
+    LAYOUT_INLINE       // no sectors, the data is in the inode
+};
+
+/* LENGTH consecutive disk sectors starting at START. */
+struct extent {
+    block_sector_t start;
+    block_sector_t length;
+};
+
 /* On-disk inode.
-   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+   Must be exactly BLOCK_SECTOR_SIZE bytes long.
+
+   New inodes map their data with extents, which keeps a large
+   sequential file down to a few runs that byte_to_sector() finds
+   without reading any indirect block.  A file that needs more
+   than EXTENTS_COUNT runs migrates to the block map, which is
+   also what inodes written before extents existed use: their
+   layout field reads as LAYOUT_BLOCK_MAP since it occupies the
+   zero upper half of the old 32-bit type field.
+
+   A file of at most INLINE_DATA_SIZE bytes keeps its data in
+   place of the map, so opening and reading it costs only the
+   inode sector.  It moves to extents once it grows larger. */
 struct inode_disk {
-    block_sector_t direct_blocks[DIRECT_BLOCKS_COUNT];
-    block_sector_t indirect_block;
-    block_sector_t doubly_indirect_block;
-    InodeType type;
+    union {
+        struct {                        /* LAYOUT_BLOCK_MAP. */
+            block_sector_t direct_blocks[DIRECT_BLOCKS_COUNT];
+            block_sector_t indirect_block;
+            block_sector_t doubly_indirect_block;
+        };
+        struct {                        /* LAYOUT_EXTENTS. */
+            struct extent extents[EXTENTS_COUNT];
+            uint32_t extent_cnt;        /* Extents in use. */
+        };
+        uint8_t inline_data[INLINE_DATA_SIZE]; /* LAYOUT_INLINE. */
+    };
+    uint16_t type;                      /* InodeType. */
+    uint16_t layout;                    /* enum inode_layout. */
     off_t length;                       /* File size in bytes. */
     unsigned magic;                     /* Magic number. */
 };
@@ -30,26 +77,118 @@ static inline int min(int a, int b) {
     return a < b ? a : b;
 }
 
-static bool allocate_inode(struct inode_disk *inode, off_t file_length);
+static inline int max(int a, int b) {
+    return a > b ? a : b;
+}
+
+static bool allocate_sectors(struct inode_disk *inode, size_t first, size_t cnt, block_sector_t home, bool *changed);
 
 static bool free_inode(struct inode_disk *inode);
 
-static block_sector_t singly_indirect_inode(block_sector_t indirect, int idx) {
-    idx -= DIRECT_BLOCKS_COUNT;
+static bool flush_delayed(struct inode *inode);
+
+/* Returns entry IDX of indirect block INDIRECT, read in place
+   from the buffer cache. */
+static block_sector_t read_indirect_entry(block_sector_t indirect, int idx) {
     ASSERT(0 <= idx && idx < INDIRECT_BLOCKS_PER_SECTOR);
 
-    block_sector_t buffer[INDIRECT_BLOCKS_PER_SECTOR];
-    read_buffer_cache(indirect, buffer);
-    return buffer[idx];
+    const block_sector_t *blocks = cache_get(indirect, CACHE_READ);
+    block_sector_t sector = blocks[idx];
+    cache_put(blocks, false);
+    return sector;
 }
 
-static block_sector_t doubly_indirect_inode(block_sector_t doubly_indirect, int idx) {
+/* Decoded copies of the indirect blocks of a block-mapped inode,
+   each read from the buffer cache on first use, so that a large
+   file pays for its metadata once rather than on every access. */
+struct block_map_cache {
+    block_sector_t *indirect;                               // indirect_block
+    block_sector_t *doubly;                                 // doubly_indirect_block
+    block_sector_t *leaves[INDIRECT_BLOCKS_PER_SECTOR];     // blocks doubly points to
+};
+
+/* Returns the decoded copy of indirect block SECTOR kept in
+   *SLOT, reading it in first if *SLOT is null.  Returns a null
+   pointer if memory is short. */
+static const block_sector_t *decode_indirect(block_sector_t **slot, block_sector_t sector) {
+    if (*slot == NULL) {
+        *slot = malloc(BLOCK_SECTOR_SIZE);
+        if (*slot != NULL)
+            read_buffer_cache(sector, *slot);
+    }
+    return *slot;
+}
+
+/* Frees MAP and every block it decoded. */
+static void free_block_map_cache(struct block_map_cache *map) {
+    if (map != NULL) {
+        free(map->indirect);
+        free(map->doubly);
+        for (int i = 0; i < INDIRECT_BLOCKS_PER_SECTOR; i++) {
+            free(map->leaves[i]);
+        }
+        free(map);
+    }
+}
+
+/* The lookups below fall back to reading the indirect blocks
+   through the buffer cache when MAP is null or memory is short.
+   They return 0 for a hole, including one left by an indirect
+   block that was never allocated. */
+
+static block_sector_t singly_indirect_inode(struct block_map_cache *map, block_sector_t indirect, int idx) {
+    idx -= DIRECT_BLOCKS_COUNT;
+    if (indirect == 0)
+        return 0;
+
+    const block_sector_t *blocks = map != NULL ? decode_indirect(&map->indirect, indirect) : NULL;
+    return blocks != NULL ? blocks[idx] : read_indirect_entry(indirect, idx);
+}
+
+static block_sector_t doubly_indirect_inode(struct block_map_cache *map, block_sector_t doubly_indirect, int idx) {
     idx -= (DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR);
     ASSERT(0 <= idx && idx < INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR);
+    int outer = idx / INDIRECT_BLOCKS_PER_SECTOR;
+    int inner = idx % INDIRECT_BLOCKS_PER_SECTOR;
+    if (doubly_indirect == 0)
+        return 0;
+
+    const block_sector_t *top = map != NULL ? decode_indirect(&map->doubly, doubly_indirect) : NULL;
+    block_sector_t indirect = top != NULL ? top[outer] : read_indirect_entry(doubly_indirect, outer);
+    if (indirect == 0)
+        return 0;
 
-    block_sector_t buffer[INDIRECT_BLOCKS_PER_SECTOR];
-    read_buffer_cache(doubly_indirect, buffer);
-    return singly_indirect_inode(buffer[idx / 128], idx % 128);
+    const block_sector_t *leaf = top != NULL ? decode_indirect(&map->leaves[outer], indirect) : NULL;
+    return leaf != NULL ? leaf[inner] : read_indirect_entry(indirect, inner);
+}
+
+/* Returns the disk sector holding sector IDX of the file mapped
+   by the extents of DISK_INODE, or 0 if IDX lies in a hole.  A
+   hole is an extent starting at sector 0, which always holds the
+   free map inode, or anything past the last extent. */
+static block_sector_t extent_to_sector(const struct inode_disk *disk_inode, size_t idx) {
+    for (size_t i = 0; i < disk_inode->extent_cnt; i++) {
+        const struct extent *e = &disk_inode->extents[i];
+        if (idx < e->length)
+            return e->start != 0 ? e->start + idx : 0;
+        idx -= e->length;
+    }
+    return 0;
+}
+
+/* Returns the disk sector holding sector IDX of the file
+   described by DISK_INODE, or 0 if IDX lies in a hole.  MAP, if
+   nonnull, caches the decoded indirect blocks of a block map. */
+static block_sector_t lookup_sector(const struct inode_disk *disk_inode, struct block_map_cache *map, int idx) {
+    if (disk_inode->layout == LAYOUT_EXTENTS) {
+        return extent_to_sector(disk_inode, idx);
+    } else if (idx < DIRECT_BLOCKS_COUNT) {
+        return disk_inode->direct_blocks[idx];
+    } else if (idx < DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR) {
+        return singly_indirect_inode(map, disk_inode->indirect_block, idx);
+    } else {
+        return doubly_indirect_inode(map, disk_inode->doubly_indirect_block, idx);
+    }
 }
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -60,12 +199,52 @@ static inline size_t bytes_to_sectors(off_t size) {
 
 /* In-memory inode. */
 struct inode {
-    struct list_elem elem;              /* Element in inode list. */
+    struct hash_elem elem;              /* Element in open_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;             /* Inode content. */
+    struct rwlock rw;                   /* Protects data, deny_write_cnt and
+                                           the file's contents. */
+    struct lock dir_lock;               /* Serializes changes to the entries
+                                           of a directory. */
+    struct lock map_lock;               /* Protects map_cache. */
+    struct block_map_cache *map_cache;  /* Decoded indirect blocks, or null. */
+    struct delayed_tail *tail;          /* Unallocated appended data, or null. */
+    bool write_error;                   /* A tail failed to be allocated since
+                                           the last inode_sync(). */
+};
+
+/* Delayed allocation.  Data appended to a regular file past its
+   last mapped sector is kept in memory, in the file's tail, with
+   no disk sector chosen for it and no change to the inode sector
+   beyond the in-memory length.  The tail's sectors are allocated
+   together, as a single run next to the rest of the file, once it
+   fills up or the data has to reach the disk: on write-back,
+   fsync, or a write that is not a plain append.  A file built
+   from many small appends thus ends up as contiguous as one
+   written at once, for one allocation and one inode update per
+   batch.
+
+   Until then the tail's sectors are holes on disk, so the file
+   reads as zeros there after a crash, up to its length as of the
+   last inode update.  If the disk is full by the time the tail is
+   allocated, its data is dropped, the file goes back to the length
+   it had before the tail, and the next inode_sync() reports the
+   failure.
+
+   A closed file keeps its tail until the write-behind thread
+   allocates it, so with -cache-flush=0 every file appended to
+   since the last sync holds its tail until shutdown.  A tail
+   therefore grows with the data appended, doubling as needed up
+   to DELAYED_SECTORS, rather than taking the maximum up front. */
+struct delayed_tail {
+    off_t length;                       /* File length before the tail. */
+    size_t first;                       /* First file sector held. */
+    size_t cnt;                         /* Sectors held, from FIRST on. */
+    size_t cap;                         /* Sectors DATA has room for. */
+    uint8_t data[];
 };
 
 bool is_directory(const struct inode *inode) {
@@ -76,38 +255,89 @@ bool is_removed(const struct inode *inode){
     return inode->removed;
 }
 
+/* Returns true if INODE's data is file system metadata, whose
+   changes go through the journal: a directory, a directory's
+   index or the free map. */
+static bool is_metadata(const struct inode *inode) {
+    return inode->data.type != FILE || inode->sector == FREE_MAP_SECTOR;
+}
+
+/* Writes metadata sector SECTOR from DATA as part of the running
+   transaction. */
+static void write_metadata(block_sector_t sector, const void *data) {
+    journal_log(sector);
+    write_buffer_cache(sector, data);
+}
+
 /* Returns the block device sector that contains byte offset POS
    within INODE.
+   Returns 0 if POS lies in a hole, which reads as zeros.
    Returns -1 if INODE does not contain data for a byte at offset
    POS. */
-static block_sector_t byte_to_sector(const struct inode *inode, off_t pos) {
+static block_sector_t byte_to_sector(struct inode *inode, off_t pos) {
     ASSERT(inode != NULL);
     if (pos < inode->data.length) {
         int idx = pos / BLOCK_SECTOR_SIZE;
-        if (idx < DIRECT_BLOCKS_COUNT) {
-            return inode->data.direct_blocks[idx];
-        } else if (idx < DIRECT_BLOCKS_COUNT + INDIRECT_BLOCKS_PER_SECTOR) {
-            return singly_indirect_inode(inode->data.indirect_block, idx);
-        } else {
-            return doubly_indirect_inode(inode->data.doubly_indirect_block, idx);
+        if (inode->data.layout == LAYOUT_EXTENTS || idx < DIRECT_BLOCKS_COUNT) {
+            return lookup_sector(&inode->data, NULL, idx);
         }
+
+        lock_acquire(&inode->map_lock);
+        if (inode->map_cache == NULL)
+            inode->map_cache = calloc(1, sizeof *inode->map_cache);
+        block_sector_t sector = lookup_sector(&inode->data, inode->map_cache, idx);
+        lock_release(&inode->map_lock);
+        return sector;
     } else {
         return -1;
     }
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Forgets INODE's decoded indirect blocks, which must be done
+   whenever its block map changes. */
+static void drop_block_map_cache(struct inode *inode) {
+    lock_acquire(&inode->map_lock);
+    free_block_map_cache(inode->map_cache);
+    inode->map_cache = NULL;
+    lock_release(&inode->map_lock);
+}
+
+/* Open inodes, keyed by sector, so that opening a single inode
+   twice returns the same `struct inode'.  open_inodes_lock
+   protects the table and every open_cnt. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+
+static unsigned inode_hash(const struct hash_elem *e, void *aux UNUSED) {
+    return hash_int((int) hash_entry(e, struct inode, elem)->sector);
+}
+
+static bool inode_less(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED) {
+    return hash_entry(a, struct inode, elem)->sector < hash_entry(b, struct inode, elem)->sector;
+}
+
+/* Returns the open inode for SECTOR, or a null pointer.
+   open_inodes_lock must be held. */
+static struct inode *find_open_inode(block_sector_t sector) {
+    ASSERT(lock_held_by_current_thread(&open_inodes_lock));
+
+    struct inode key;
+    key.sector = sector;
+    struct hash_elem *e = hash_find(&open_inodes, &key.elem);
+    return e != NULL ? hash_entry(e, struct inode, elem) : NULL;
+}
 
 /* Initializes the inode module. */
 void inode_init(void) {
-    list_init(&open_inodes);
+    if (!hash_init(&open_inodes, inode_hash, inode_less, NULL))
+        PANIC("open inode table creation failed");
+    lock_init(&open_inodes_lock);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
-   device.
+   device.  The data starts out as a hole, so no data sector is
+   allocated until it is first written.
    Returns true if successful.
    Returns false if memory or disk allocation fails. */
 bool inode_create(block_sector_t sector, off_t length, InodeType type) {
@@ -120,18 +350,30 @@ bool inode_create(block_sector_t sector, off_t length, InodeType type) {
        one sector in size, and you should fix that. */
     ASSERT(sizeof *disk_inode == BLOCK_SECTOR_SIZE);
 
+    journal_begin();
     disk_inode = calloc(1, sizeof *disk_inode);
     if (disk_inode != NULL) {
         size_t sectors = bytes_to_sectors(length);
         disk_inode->type = type;
+        disk_inode->layout = LAYOUT_EXTENTS;
         disk_inode->length = length;
         disk_inode->magic = INODE_MAGIC;
-        if (allocate_inode(disk_inode, disk_inode->length)) {
-            write_buffer_cache(sector, disk_inode);
+        /* Filling a hole in the free map file would allocate from
+           the free map while writing it, so allocate it up front.
+           bitmap_read() and bitmap_write() also expect it on
+           whole sectors. */
+        bool changed;
+        if (sector != FREE_MAP_SECTOR && (size_t) length <= INLINE_DATA_SIZE) {
+            disk_inode->layout = LAYOUT_INLINE;
+            write_metadata(sector, disk_inode);
+            success = true;
+        } else if (sector != FREE_MAP_SECTOR || allocate_sectors(disk_inode, 0, sectors, sector, &changed)) {
+            write_metadata(sector, disk_inode);
             success = true;
         }
         free(disk_inode);
     }
+    journal_end();
     return success;
 }
 
@@ -139,39 +381,58 @@ bool inode_create(block_sector_t sector, off_t length, InodeType type) {
    and returns a `struct inode' that contains it.
    Returns a null pointer if memory allocation fails. */
 struct inode *inode_open(block_sector_t sector) {
-    struct list_elem *e;
     struct inode *inode;
 
     /* Check whether this inode is already open. */
-    for (e = list_begin(&open_inodes); e != list_end(&open_inodes);
-         e = list_next(e)) {
-        inode = list_entry(e,
-        struct inode, elem);
-        if (inode->sector == sector) {
-            inode_reopen(inode);
-            return inode;
-        }
+    lock_acquire(&open_inodes_lock);
+    inode = find_open_inode(sector);
+    if (inode != NULL) {
+        inode->open_cnt++;
+        lock_release(&open_inodes_lock);
+        return inode;
     }
+    lock_release(&open_inodes_lock);
 
     /* Allocate memory. */
     inode = malloc(sizeof *inode);
     if (inode == NULL)
         return NULL;
 
-    /* Initialize. */
-    list_push_front(&open_inodes, &inode->elem);
+    /* Initialize, reading the disk inode without holding
+       open_inodes_lock. */
     inode->sector = sector;
     inode->open_cnt = 1;
     inode->deny_write_cnt = 0;
     inode->removed = false;
+    rwlock_init(&inode->rw);
+    lock_init(&inode->dir_lock);
+    lock_init(&inode->map_lock);
+    inode->map_cache = NULL;
+    inode->tail = NULL;
+    inode->write_error = false;
     read_buffer_cache(inode->sector, &inode->data);
+
+    /* Someone else may have opened SECTOR meanwhile. */
+    lock_acquire(&open_inodes_lock);
+    struct inode *other = find_open_inode(sector);
+    if (other != NULL) {
+        other->open_cnt++;
+        lock_release(&open_inodes_lock);
+        free(inode);
+        return other;
+    }
+    hash_insert(&open_inodes, &inode->elem);
+    lock_release(&open_inodes_lock);
     return inode;
 }
 
 /* Reopens and returns INODE. */
 struct inode *inode_reopen(struct inode *inode) {
-    if (inode != NULL)
+    if (inode != NULL) {
+        lock_acquire(&open_inodes_lock);
         inode->open_cnt++;
+        lock_release(&open_inodes_lock);
+    }
     return inode;
 }
 
@@ -188,17 +449,33 @@ void inode_close(struct inode *inode) {
     if (inode == NULL)
         return;
 
-    /* Release resources if this was the last opener. */
-    if (--inode->open_cnt == 0) {
-        /* Remove from inode list and release lock. */
-        list_remove(&inode->elem);
+    /* Release resources if this was the last opener.  An inode
+       whose tail is still unallocated stays in open_inodes, with
+       no openers, until inode_flush_delayed() allocates it: callers
+       may hold directory locks here, and allocating the tail would
+       begin a transaction, which must not wait for a commit with
+       those held. */
+    lock_acquire(&open_inodes_lock);
+    bool last = --inode->open_cnt == 0 && (inode->tail == NULL || inode->removed);
+    if (last) {
+        hash_delete(&open_inodes, &inode->elem);
+    }
+    lock_release(&open_inodes_lock);
 
-        /* Deallocate blocks if removed. */
+    if (last) {
+        /* Deallocate blocks if removed, as one transaction.  A
+           caller that closes a removed inode with a directory
+           locked, as dir_remove() does, is inside a transaction
+           already, so this never waits for a commit with it. */
         if (inode->removed) {
+            journal_begin();
             free_map_release(inode->sector, 1);
             free_inode(&inode->data);
+            journal_end();
         }
 
+        free_block_map_cache(inode->map_cache);
+        free(inode->tail);
         free(inode);
     }
 }
@@ -210,13 +487,176 @@ void inode_remove(struct inode *inode) {
     inode->removed = true;
 }
 
-/* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
-   Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
-off_t inode_read_at(struct inode *inode, void *buffer_, off_t size, off_t offset) {
+/* Acquires the lock on the entries of directory INODE, which
+   directory.c holds while it searches or changes them. */
+void inode_lock_dir(struct inode *inode) {
+    lock_acquire(&inode->dir_lock);
+}
+
+/* Releases the lock acquired by inode_lock_dir(). */
+void inode_unlock_dir(struct inode *inode) {
+    lock_release(&inode->dir_lock);
+}
+
+/* Returns the number of file sectors the extents of DISK_INODE
+   cover, holes included. */
+static size_t mapped_sectors(const struct inode_disk *disk_inode) {
+    size_t cnt = 0;
+
+    for (size_t i = 0; i < disk_inode->extent_cnt; i++) {
+        cnt += disk_inode->extents[i].length;
+    }
+    return cnt;
+}
+
+/* Returns the data of file sector IDX of INODE if its tail holds
+   it, or a null pointer. */
+static uint8_t *tail_sector(struct inode *inode, size_t idx) {
+    struct delayed_tail *tail = inode->tail;
+
+    if (tail == NULL || idx < tail->first || idx >= tail->first + tail->cnt)
+        return NULL;
+    return tail->data + (idx - tail->first) * BLOCK_SECTOR_SIZE;
+}
+
+/* Prepares the append of SIZE bytes at OFFSET to INODE for
+   delayed allocation, which is possible if the write ends past
+   the end of the file, the sectors it touches up to the last
+   mapped one are allocated, and the tail has room for the rest.
+   Extends the tail and the file's length in memory and returns
+   true if so.  INODE's rw must be held for writing. */
+static bool delay_append(struct inode *inode, off_t size, off_t offset) {
+    struct inode_disk *disk = &inode->data;
+    size_t first = offset / BLOCK_SECTOR_SIZE;
+    size_t end = bytes_to_sectors(offset + size);
+
+    if (is_metadata(inode) || disk->layout != LAYOUT_EXTENTS || offset + size <= disk->length)
+        return false;
+
+    size_t mapped = inode->tail != NULL ? inode->tail->first : mapped_sectors(disk);
+    if (end > mapped + DELAYED_SECTORS)
+        return false;
+    for (size_t i = first; i < end && i < mapped; i++) {
+        if (lookup_sector(disk, NULL, i) == 0)
+            return false;
+    }
+
+    struct delayed_tail *tail = inode->tail;
+    size_t cap = tail != NULL ? tail->cap : 0;
+    if (end > mapped + cap) {
+        size_t new_cap = cap > 0 ? cap : 1;
+        while (new_cap < end - mapped)
+            new_cap *= 2;
+        if (new_cap > DELAYED_SECTORS)
+            new_cap = DELAYED_SECTORS;
+        tail = realloc(tail, sizeof *tail + new_cap * BLOCK_SECTOR_SIZE);
+        if (tail == NULL)
+            return false;
+        memset(tail->data + cap * BLOCK_SECTOR_SIZE, 0, (new_cap - cap) * BLOCK_SECTOR_SIZE);
+        if (inode->tail == NULL) {
+            tail->length = disk->length;
+            tail->first = mapped;
+            tail->cnt = 0;
+        }
+        tail->cap = new_cap;
+        inode->tail = tail;
+    }
+    if (end > mapped + tail->cnt)
+        tail->cnt = end - mapped;
+    disk->length = offset + size;
+    return true;
+}
+
+/* Allocates the sectors of INODE's tail as one run, moves its
+   data into them and writes the inode.  Returns false if the disk
+   is full, in which case the tail's data is lost, INODE's length
+   is restored to what it was before the tail and the failure is
+   kept for inode_sync() to report.  INODE's rw must be held for
+   writing. */
+static bool flush_delayed_locked(struct inode *inode) {
+    struct delayed_tail *tail = inode->tail;
+    bool changed = false;
+
+    if (tail == NULL)
+        return true;
+    inode->tail = NULL;
+
+    bool success = allocate_sectors(&inode->data, tail->first, tail->cnt, inode->sector, &changed);
+    if (changed)
+        drop_block_map_cache(inode);
+    for (size_t i = 0; success && i < tail->cnt; i++) {
+        block_sector_t sector = byte_to_sector(inode, (tail->first + i) * BLOCK_SECTOR_SIZE);
+        write_buffer_cache(sector, tail->data + i * BLOCK_SECTOR_SIZE);
+    }
+    if (!success) {
+        inode->data.length = tail->length;
+        inode->write_error = true;
+    }
+    write_metadata(inode->sector, &inode->data);
+    free(tail);
+    return success;
+}
+
+/* Allocates INODE's tail, if it has one.  Returns false if the
+   disk is full. */
+static bool flush_delayed(struct inode *inode) {
+    journal_begin();
+    rwlock_acquire_write(&inode->rw);
+    bool success = flush_delayed_locked(inode);
+    rwlock_release_write(&inode->rw);
+    journal_end();
+    return success;
+}
+
+/* Allocates the tails of every open inode, so that the data
+   appended to them can be written back, and frees the inodes kept
+   only for their tails.  Called before the buffer cache is
+   flushed, with no file system lock held. */
+void inode_flush_delayed(void) {
+    struct inode **inodes = NULL;
+    size_t cnt = 0, cap = 0;
+    struct hash_iterator i;
+
+    /* Collect them first: flushing takes locks that must not be
+       acquired with open_inodes_lock held. */
+    lock_acquire(&open_inodes_lock);
+    hash_first(&i, &open_inodes);
+    while (hash_next(&i)) {
+        struct inode *inode = hash_entry(hash_cur(&i), struct inode, elem);
+        if (inode->tail == NULL)
+            continue;
+        if (cnt == cap) {
+            size_t new_cap = cap > 0 ? cap * 2 : 16;
+            struct inode **p = realloc(inodes, new_cap * sizeof *p);
+            if (p == NULL)
+                break;
+            inodes = p;
+            cap = new_cap;
+        }
+        inode->open_cnt++;
+        inodes[cnt++] = inode;
+    }
+    lock_release(&open_inodes_lock);
+
+    for (size_t j = 0; j < cnt; j++) {
+        flush_delayed(inodes[j]);
+        inode_close(inodes[j]);
+    }
+    free(inodes);
+}
+
+/* Reads like inode_read_at() with INODE's rw held for reading. */
+static off_t read_at(struct inode *inode, void *buffer_, off_t size, off_t offset) {
     uint8_t *buffer = buffer_;
     off_t bytes_read = 0;
-    uint8_t *bounce = NULL;
+
+    if (inode->data.layout == LAYOUT_INLINE) {
+        if (offset >= inode->data.length)
+            return 0;
+        bytes_read = min(size, inode->data.length - offset);
+        memcpy(buffer, inode->data.inline_data + offset, bytes_read);
+        return bytes_read;
+    }
 
     while (size > 0) {
         /* Disk sector to read, starting byte offset within sector. */
@@ -233,19 +673,21 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size, off_t offset
         if (chunk_size <= 0)
             break;
 
-        if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE) {
+        const uint8_t *delayed = tail_sector(inode, offset / BLOCK_SECTOR_SIZE);
+        if (delayed != NULL) {
+            /* Appended data not allocated yet. */
+            memcpy(buffer + bytes_read, delayed + sector_ofs, chunk_size);
+        } else if (sector_idx == 0) {
+            /* Holes read as zeros. */
+            memset(buffer + bytes_read, 0, chunk_size);
+        } else if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE) {
             /* Read full sector directly into caller's buffer. */
             read_buffer_cache(sector_idx, buffer + bytes_read);
         } else {
-            /* Read sector into bounce buffer, then partially copy
-               into caller's buffer. */
-            if (bounce == NULL) {
-                bounce = malloc(BLOCK_SECTOR_SIZE);
-                if (bounce == NULL)
-                    break;
-            }
-            read_buffer_cache(sector_idx, bounce);
-            memcpy(buffer + bytes_read, bounce + sector_ofs, chunk_size);
+            /* Copy the part we need straight out of the cache. */
+            const uint8_t *data = cache_get(sector_idx, CACHE_READ);
+            memcpy(buffer + bytes_read, data + sector_ofs, chunk_size);
+            cache_put(data, false);
         }
 
         /* Advance. */
@@ -253,31 +695,121 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size, off_t offset
         offset += chunk_size;
         bytes_read += chunk_size;
     }
-    free(bounce);
+
+    /* Prefetch the file's next sector for a sequential reader. */
+    if (bytes_read > 0) {
+        off_t next = ROUND_UP(offset, BLOCK_SECTOR_SIZE);
+        if (next < inode_length(inode)) {
+            block_sector_t sector = byte_to_sector(inode, next);
+            if (sector != 0)
+                read_ahead_buffer_cache(sector);
+        }
+    }
 
     return bytes_read;
 }
 
-/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
-   Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
-off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size, off_t offset) {
+/* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
+   Returns the number of bytes actually read, which may be less
+   than SIZE if an error occurs or end of file is reached.
+   Any number of threads may read an inode at once. */
+off_t inode_read_at(struct inode *inode, void *buffer, off_t size, off_t offset) {
+    rwlock_acquire_read(&inode->rw);
+    off_t bytes_read = read_at(inode, buffer, size, offset);
+    rwlock_release_read(&inode->rw);
+    return bytes_read;
+}
+
+/* Moves the inline data of INODE out to a newly allocated data
+   sector and maps it with extents.  The inode sector itself is
+   written by the caller, after the file has grown. */
+static bool promote_inline(struct inode *inode) {
+    struct inode_disk *disk = &inode->data;
+    ASSERT(disk->layout == LAYOUT_INLINE);
+
+    uint8_t *data = calloc(1, BLOCK_SECTOR_SIZE);
+    if (data == NULL)
+        return false;
+    memcpy(data, disk->inline_data, INLINE_DATA_SIZE);
+
+    memset(disk->inline_data, 0, INLINE_DATA_SIZE);
+    disk->layout = LAYOUT_EXTENTS;
+    bool changed;
+    if (disk->length > 0 && !allocate_sectors(disk, 0, 1, inode->sector, &changed)) {
+        memcpy(disk->inline_data, data, INLINE_DATA_SIZE);
+        disk->layout = LAYOUT_INLINE;
+        free(data);
+        return false;
+    }
+    if (disk->length > 0) {
+        block_sector_t sector = extent_to_sector(disk, 0);
+        if (is_metadata(inode))
+            journal_log(sector);
+        write_buffer_cache(sector, data);
+    }
+    free(data);
+    return true;
+}
+
+/* Finishes an allocation for a write that ends at END: extends
+   INODE's length to END if the allocation was a SUCCESS, and
+   writes the inode sector if that or the allocation CHANGED it.
+   Returns SUCCESS.  INODE's rw must be held for writing. */
+static bool extend_inode(struct inode *inode, off_t end, bool success, bool changed) {
+    if (end > inode->data.length) {
+        if (success)
+            inode->data.length = end;
+        changed = true;
+    }
+    if (changed) {
+        drop_block_map_cache(inode);
+        write_metadata(inode->sector, &inode->data);
+    }
+    return success;
+}
+
+/* Allocates the sectors of INODE that a write of SIZE bytes at
+   OFFSET covers, all at once, and extends INODE's length to the
+   end of the write, writing the inode sector if either changed.
+   Returns false if the disk is full.  INODE's rw must be held for
+   writing. */
+static bool allocate_write(struct inode *inode, off_t size, off_t offset) {
+    size_t first = offset / BLOCK_SECTOR_SIZE;
+    size_t end = bytes_to_sectors(offset + size);
+    bool changed = false;
+    bool success = allocate_sectors(&inode->data, first, end - first, inode->sector, &changed);
+
+    return extend_inode(inode, offset + size, success, changed);
+}
+
+/* Writes like inode_write_at() with INODE's rw held for
+   writing. */
+static off_t write_at(struct inode *inode, const void *buffer_, off_t size, off_t offset) {
     const uint8_t *buffer = buffer_;
     off_t bytes_written = 0;
-    uint8_t *bounce = NULL;
 
     if (inode->deny_write_cnt)
         return 0;
-    if (byte_to_sector(inode, offset + size - 1) == -1u) {
-        //extend file system
-        bool success = allocate_inode(&inode->data, offset + size);
-        if (!success) return 0;
-
-        inode->data.length = offset + size;
-        write_buffer_cache(inode->sector, &inode->data);
+    if (inode->data.layout == LAYOUT_INLINE && size > 0) {
+        if ((size_t) (offset + size) <= INLINE_DATA_SIZE) {
+            memcpy(inode->data.inline_data + offset, buffer, size);
+            if (offset + size > inode->data.length)
+                inode->data.length = offset + size;
+            write_metadata(inode->sector, &inode->data);
+            return size;
+        }
+        if (!promote_inline(inode))
+            return 0;
     }
+    bool delayed = size > 0 && delay_append(inode, size, offset);
+    if (size > 0 && !delayed && inode->tail != NULL) {
+        /* Allocate the tail first, then try again with a new one. */
+        if (!flush_delayed_locked(inode))
+            return 0;
+        delayed = delay_append(inode, size, offset);
+    }
+    if (size > 0 && !delayed && !allocate_write(inode, size, offset))
+        return 0;
 
     while (size > 0) {
         /* Sector to write, starting byte offset within sector. */
@@ -294,26 +826,15 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size, off_t
         if (chunk_size <= 0)
             break;
 
-        if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE) {
-            /* Write full sector directly to disk. */
-            write_buffer_cache(sector_idx, buffer + bytes_written);
+        /* Merge the chunk into the tail or the cached sector.  A
+           full sector is not read from disk first. */
+        uint8_t *tail = tail_sector(inode, offset / BLOCK_SECTOR_SIZE);
+        if (tail != NULL) {
+            memcpy(tail + sector_ofs, buffer + bytes_written, chunk_size);
         } else {
-            /* We need a bounce buffer. */
-            if (bounce == NULL) {
-                bounce = malloc(BLOCK_SECTOR_SIZE);
-                if (bounce == NULL)
-                    break;
-            }
-
-            /* If the sector contains data before or after the chunk
-               we're writing, then we need to read in the sector
-               first.  Otherwise we start with a sector of all zeros. */
-            if (sector_ofs > 0 || chunk_size < sector_left)
-                read_buffer_cache(sector_idx, bounce);
-            else
-                memset(bounce, 0, BLOCK_SECTOR_SIZE);
-            memcpy(bounce + sector_ofs, buffer + bytes_written, chunk_size);
-            write_buffer_cache(sector_idx, bounce);
+            if (is_metadata(inode))
+                journal_log(sector_idx);
+            write_buffer_cache_at(sector_idx, buffer + bytes_written, sector_ofs, chunk_size);
         }
 
         /* Advance. */
@@ -321,25 +842,187 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size, off_t
         offset += chunk_size;
         bytes_written += chunk_size;
     }
-    free(bounce);
 
     return bytes_written;
 }
 
+/* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
+   Returns the number of bytes actually written, which may be
+   less than SIZE if end of file is reached or an error occurs.
+   A write past end of file extends the inode, leaving a hole
+   between the old end and OFFSET.  Only the sectors written are
+   allocated, and those of an append only later, in a batch.
+   Writes exclude reads and other writes of the same inode only.
+   Each write is a journal transaction, or part of the caller's. */
+off_t inode_write_at(struct inode *inode, const void *buffer, off_t size, off_t offset) {
+    journal_begin();
+    rwlock_acquire_write(&inode->rw);
+    off_t bytes_written = write_at(inode, buffer, size, offset);
+    rwlock_release_write(&inode->rw);
+    journal_end();
+    return bytes_written;
+}
+
+/* Acquires INODE's rw for a copy, for writing if WRITE, which it
+   is for the destination. */
+static void lock_copy(struct inode *inode, bool write) {
+    if (write)
+        rwlock_acquire_write(&inode->rw);
+    else
+        rwlock_acquire_read(&inode->rw);
+}
+
+/* Releases the rw acquired by lock_copy(). */
+static void unlock_copy(struct inode *inode, bool write) {
+    if (write)
+        rwlock_release_write(&inode->rw);
+    else
+        rwlock_release_read(&inode->rw);
+}
+
+/* Returns true if any of the SIZE bytes of INODE starting at POS
+   lies outside a hole.  INODE's rw must be held. */
+static bool has_data(struct inode *inode, off_t pos, off_t size) {
+    for (off_t p = ROUND_DOWN(pos, BLOCK_SECTOR_SIZE); p < pos + size; p += BLOCK_SECTOR_SIZE) {
+        if (tail_sector(inode, p / BLOCK_SECTOR_SIZE) != NULL || byte_to_sector(inode, p) != 0)
+            return true;
+    }
+    return false;
+}
+
+/* Allocates the sectors of OUT that a copy of SIZE bytes of IN
+   from IN_OFS to OUT_OFS puts data in, one run of consecutive
+   sectors at a time, and extends OUT's length to the end of the
+   copy.  Sectors that would receive only holes of IN are left
+   holes.  Returns false if the disk is full.  OUT's rw must be
+   held for writing. */
+static bool allocate_copy(struct inode *in, off_t in_ofs, struct inode *out, off_t out_ofs, off_t size) {
+    size_t first = out_ofs / BLOCK_SECTOR_SIZE;
+    size_t end = bytes_to_sectors(out_ofs + size);
+    bool changed = false;
+    bool success = true;
+
+    size_t run = first;
+    for (size_t i = first; success && i <= end; i++) {
+        bool needed = false;
+        if (i < end) {
+            off_t lo = max(out_ofs, i * BLOCK_SECTOR_SIZE);
+            off_t hi = min(out_ofs + size, (i + 1) * BLOCK_SECTOR_SIZE);
+            needed = has_data(in, lo - out_ofs + in_ofs, hi - lo);
+        }
+        if (!needed) {
+            if (i > run)
+                success = allocate_sectors(&out->data, run, i - run, out->sector, &changed);
+            run = i + 1;
+        }
+    }
+    return extend_inode(out, out_ofs + size, success, changed);
+}
+
+/* Copies SIZE bytes of IN, starting at IN_OFS, into OUT at
+   OUT_OFS.  Returns the number of bytes copied, which is less
+   than SIZE only at the end of IN, or -1 if nothing could be
+   copied: if OUT denies writes, if IN and OUT are the same inode
+   and the two ranges overlap, or if the disk is full.
+
+   The data moves from cache sector to cache sector, without a
+   copy in between.  OUT's sectors for the whole range are
+   allocated up front, as few runs as the free map allows, and
+   its inode is written once.  Holes in IN stay holes in OUT
+   wherever OUT had none allocated. */
+off_t inode_copy_at(struct inode *in, off_t in_ofs, struct inode *out, off_t out_ofs, off_t size) {
+    static const uint8_t zeros[BLOCK_SECTOR_SIZE];
+    off_t copied = 0;
+    bool failed = true;
+
+    /* Lock the two in inode order, which every copy does, so two
+       copies in opposite directions cannot deadlock.  IN is only
+       read. */
+    struct inode *first = in->sector <= out->sector ? in : out;
+    struct inode *second = first == in ? out : in;
+    journal_begin();
+    lock_copy(first, first == out);
+    if (second != first)
+        lock_copy(second, second == out);
+
+    if (size > in->data.length - in_ofs)
+        size = in->data.length - in_ofs;
+    if (size <= 0) {
+        failed = false;
+        goto done;
+    }
+    if (out->deny_write_cnt || (in == out && in_ofs < out_ofs + size && out_ofs < in_ofs + size))
+        goto done;
+
+    if (in->data.layout == LAYOUT_INLINE
+        || (out->data.layout == LAYOUT_INLINE && (size_t) (out_ofs + size) <= INLINE_DATA_SIZE)) {
+        /* Small enough to pass through memory. */
+        uint8_t *data = malloc(size);
+        if (data != NULL) {
+            copied = write_at(out, data, read_at(in, data, size, in_ofs), out_ofs);
+            free(data);
+        }
+        failed = copied == 0;
+        goto done;
+    }
+
+    if (!flush_delayed_locked(out)
+        || (out->data.layout == LAYOUT_INLINE && !promote_inline(out))
+        || !allocate_copy(in, in_ofs, out, out_ofs, size))
+        goto done;
+    failed = false;
+
+    while (copied < size) {
+        int in_sector_ofs = in_ofs % BLOCK_SECTOR_SIZE;
+        int out_sector_ofs = out_ofs % BLOCK_SECTOR_SIZE;
+        int chunk_size = min(size - copied, BLOCK_SECTOR_SIZE - max(in_sector_ofs, out_sector_ofs));
+
+        /* A destination sector left a hole only receives zeros. */
+        const uint8_t *delayed = tail_sector(in, in_ofs / BLOCK_SECTOR_SIZE);
+        block_sector_t dst = byte_to_sector(out, out_ofs);
+        if (dst != 0) {
+            block_sector_t src = delayed == NULL ? byte_to_sector(in, in_ofs) : 0;
+            if (is_metadata(out))
+                journal_log(dst);
+            if (delayed != NULL)
+                write_buffer_cache_at(dst, delayed + in_sector_ofs, out_sector_ofs, chunk_size);
+            else if (src == 0)
+                write_buffer_cache_at(dst, zeros, out_sector_ofs, chunk_size);
+            else
+                copy_buffer_cache(src, in_sector_ofs, dst, out_sector_ofs, chunk_size);
+        }
+
+        in_ofs += chunk_size;
+        out_ofs += chunk_size;
+        copied += chunk_size;
+    }
+
+done:
+    if (second != first)
+        unlock_copy(second, second == out);
+    unlock_copy(first, first == out);
+    journal_end();
+    return failed ? -1 : copied;
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void inode_deny_write(struct inode *inode) {
+    rwlock_acquire_write(&inode->rw);
     inode->deny_write_cnt++;
     ASSERT(inode->deny_write_cnt <= inode->open_cnt);
+    rwlock_release_write(&inode->rw);
 }
 
 /* Re-enables writes to INODE.
    Must be called once by each inode opener who has called
    inode_deny_write() on the inode, before closing the inode. */
 void inode_allow_write(struct inode *inode) {
+    rwlock_acquire_write(&inode->rw);
     ASSERT(inode->deny_write_cnt > 0);
     ASSERT(inode->deny_write_cnt <= inode->open_cnt);
     inode->deny_write_cnt--;
+    rwlock_release_write(&inode->rw);
 }
 
 /* Returns the length, in bytes, of INODE's data. */
@@ -347,132 +1030,399 @@ off_t inode_length(const struct inode *inode) {
     return inode->data.length;
 }
 
-static void allocate_indirect_inode(block_sector_t *sector, int num_sectors, int depth) {
-    ASSERT(depth <= MAX_DEPTH);
-
-    static char empty_sector[BLOCK_SECTOR_SIZE];
+/* Adds the LEN sectors starting at START to the *CNT ranges in
+   *RANGES, which has room for *CAP, extending the last range if
+   they follow it.  Returns false if memory is short. */
+static bool add_range(struct sector_range **ranges, size_t *cnt, size_t *cap,
+                      block_sector_t start, block_sector_t len) {
+    if (*cnt > 0 && (*ranges)[*cnt - 1].start + (*ranges)[*cnt - 1].cnt == start) {
+        (*ranges)[*cnt - 1].cnt += len;
+        return true;
+    }
+    if (*cnt == *cap) {
+        size_t new_cap = *cap > 0 ? *cap * 2 : 16;
+        struct sector_range *p = realloc(*ranges, new_cap * sizeof *p);
+        if (p == NULL)
+            return false;
+        *ranges = p;
+        *cap = new_cap;
+    }
+    (*ranges)[(*cnt)++] = (struct sector_range) {start, len};
+    return true;
+}
 
-    if (depth == 0) {
-        if (*sector == 0) {
-            bool success = free_map_allocate(1, sector);
-            if(!success){
-                PANIC("free map allocate failed 1\n");
+/* Adds to the *CNT ranges in *RANGES, which has room for *CAP,
+   the disk sectors INODE occupies: its inode, its data and its
+   indirect blocks.  Returns false if memory is short.  INODE's rw
+   must be held. */
+static bool inode_ranges(struct inode *inode, struct sector_range **ranges, size_t *cnt, size_t *cap) {
+    const struct inode_disk *disk = &inode->data;
+    bool ok = add_range(ranges, cnt, cap, inode->sector, 1);
+
+    if (disk->layout == LAYOUT_EXTENTS) {
+        for (size_t i = 0; ok && i < disk->extent_cnt; i++) {
+            if (disk->extents[i].start != 0)
+                ok = add_range(ranges, cnt, cap, disk->extents[i].start, disk->extents[i].length);
+        }
+    } else if (disk->layout == LAYOUT_BLOCK_MAP) {
+        if (disk->indirect_block != 0)
+            ok = ok && add_range(ranges, cnt, cap, disk->indirect_block, 1);
+        if (disk->doubly_indirect_block != 0) {
+            ok = ok && add_range(ranges, cnt, cap, disk->doubly_indirect_block, 1);
+            for (int i = 0; ok && i < INDIRECT_BLOCKS_PER_SECTOR; i++) {
+                block_sector_t indirect = read_indirect_entry(disk->doubly_indirect_block, i);
+                if (indirect != 0)
+                    ok = add_range(ranges, cnt, cap, indirect, 1);
             }
-            write_buffer_cache(*sector, empty_sector);
         }
-        return;
+        for (off_t pos = 0; ok && pos < disk->length; pos += BLOCK_SECTOR_SIZE) {
+            block_sector_t sector = byte_to_sector(inode, pos);
+            if (sector != 0)
+                ok = add_range(ranges, cnt, cap, sector, 1);
+        }
     }
+    return ok;
+}
 
-    if (*sector == 0) {
-        bool success = free_map_allocate(1, sector);
-        if(!success){
-            PANIC("free map allocate failed 2\n");
-        }
-        write_buffer_cache(*sector, empty_sector);
+/* Writes INODE's data to disk, then commits its metadata, and
+   returns once both are durable.  The data goes first, so that no
+   committed inode ever points to sectors holding stale data.
+   The free map's pending changes go along, which matters without
+   a journal, when nothing else would write them home.  Falls back
+   to flushing the whole cache if memory is short.  Returns false
+   if appended data was lost because the disk filled up before it
+   could be allocated, now or since the last call. */
+bool inode_sync(struct inode *inode) {
+    struct sector_range *ranges = NULL;
+    size_t cnt = 0, cap = 0;
+
+    bool success = flush_delayed(inode);
+    rwlock_acquire_write(&inode->rw);
+    if (inode->write_error) {
+        inode->write_error = false;
+        success = false;
+    }
+    bool ok = inode_ranges(inode, &ranges, &cnt, &cap);
+    rwlock_release_write(&inode->rw);
+
+    free_map_flush();
+    struct inode *free_map = inode_open(FREE_MAP_SECTOR);
+    if (free_map != NULL) {
+        rwlock_acquire_read(&free_map->rw);
+        ok = ok && inode_ranges(free_map, &ranges, &cnt, &cap);
+        rwlock_release_read(&free_map->rw);
+        inode_close(free_map);
     }
 
-    block_sector_t indirect_block[INDIRECT_BLOCKS_PER_SECTOR];
-    read_buffer_cache(*sector, indirect_block);
+    if (ok && free_map != NULL)
+        flush_buffer_cache_ranges(ranges, cnt);
+    else
+        flush_buffer_cache();
+    free(ranges);
+    journal_commit();
+    return success;
+}
 
-//    write_buffer_cache(indirect_block, empty_sector);
+/* Allocates a zeroed sector as close to GOAL as possible into
+   *SECTOR. */
+static bool allocate_zeroed_sector(block_sector_t goal, block_sector_t *sector) {
+    static char empty_sector[BLOCK_SECTOR_SIZE];
 
-    int size_unit = depth == 1 ? 1 : INDIRECT_BLOCKS_PER_SECTOR;
-    int length = DIV_ROUND_UP(num_sectors, size_unit);
+    if (!free_map_allocate_near(goal, 1, sector))
+        return false;
+    write_metadata(*sector, empty_sector);
+    return true;
+}
 
-    for (int i = 0; i < length; i++) {
-        int size = min(num_sectors, size_unit);
-        allocate_indirect_inode(&indirect_block[i], size, depth - 1);
-        num_sectors -= size;
-    }
+/* Sets entry IDX of indirect block *INDIRECT to VALUE, allocating
+   the indirect block first, next to VALUE, if *INDIRECT is 0. */
+static bool set_indirect_entry(block_sector_t *indirect, int idx, block_sector_t value) {
+    ASSERT(0 <= idx && idx < INDIRECT_BLOCKS_PER_SECTOR);
 
-    ASSERT(num_sectors == 0);
-    write_buffer_cache(*sector, &indirect_block);
+    if (*indirect == 0 && !allocate_zeroed_sector(value, indirect))
+        return false;
+    journal_log(*indirect);
+    block_sector_t *blocks = cache_get(*indirect, CACHE_WRITE);
+    blocks[idx] = value;
+    cache_put(blocks, true);
+    return true;
 }
 
-static bool allocate_inode(struct inode_disk *inode, off_t file_length) {
-    static char empty_sector[BLOCK_SECTOR_SIZE];
-
-    if (file_length < 0) return false;
+/* Maps sector IDX of the block-mapped INODE to disk sector
+   SECTOR, allocating indirect blocks as needed. */
+static bool block_map_set(struct inode_disk *inode, int idx, block_sector_t sector) {
+    if (idx < DIRECT_BLOCKS_COUNT) {
+        inode->direct_blocks[idx] = sector;
+        return true;
+    }
+    idx -= DIRECT_BLOCKS_COUNT;
+    if (idx < INDIRECT_BLOCKS_PER_SECTOR)
+        return set_indirect_entry(&inode->indirect_block, idx, sector);
+    idx -= INDIRECT_BLOCKS_PER_SECTOR;
+    if (idx >= INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR)
+        return false;
+
+    int outer = idx / INDIRECT_BLOCKS_PER_SECTOR;
+    block_sector_t indirect = 0;
+    if (inode->doubly_indirect_block != 0)
+        indirect = read_indirect_entry(inode->doubly_indirect_block, outer);
+    if (indirect == 0) {
+        if (!allocate_zeroed_sector(sector, &indirect)
+            || !set_indirect_entry(&inode->doubly_indirect_block, outer, indirect))
+            return false;
+    }
+    return set_indirect_entry(&indirect, idx % INDIRECT_BLOCKS_PER_SECTOR, sector);
+}
 
-    int sectors = bytes_to_sectors(file_length);
-    int length = min(sectors, DIRECT_BLOCKS_COUNT);
+/* Releases the indirect blocks of the block-mapped INODE, but
+   not the data sectors they point to. */
+static void release_indirect_blocks(const struct inode_disk *inode) {
+    if (inode->indirect_block != 0)
+        free_map_release(inode->indirect_block, 1);
+    if (inode->doubly_indirect_block != 0) {
+        for (int i = 0; i < INDIRECT_BLOCKS_PER_SECTOR; i++) {
+            block_sector_t indirect = read_indirect_entry(inode->doubly_indirect_block, i);
+            if (indirect != 0)
+                free_map_release(indirect, 1);
+        }
+        free_map_release(inode->doubly_indirect_block, 1);
+    }
+}
 
-    for (int i = 0; i < length; i++) {
-        if (inode->direct_blocks[i] == 0) {
-            bool success = free_map_allocate(1, &inode->direct_blocks[i]);
-            if(!success){
-                PANIC("free map allocate failed 3\n");
-            }
-            write_buffer_cache(inode->direct_blocks[i], empty_sector);
+/* Converts INODE from extents to the block map, keeping every
+   data sector where it is.  The block map is built in a copy of
+   INODE that replaces it only once complete: on failure INODE is
+   left unchanged and the indirect blocks the copy got are
+   released. */
+static bool migrate_to_block_map(struct inode_disk *inode) {
+    ASSERT(inode->layout == LAYOUT_EXTENTS);
+
+    struct inode_disk *map = malloc(sizeof *map);
+    if (map == NULL)
+        return false;
+    *map = *inode;
+    memset(map->direct_blocks, 0, sizeof map->direct_blocks);
+    map->indirect_block = 0;
+    map->doubly_indirect_block = 0;
+    map->layout = LAYOUT_BLOCK_MAP;
+
+    bool success = true;
+    int idx = 0;
+    for (size_t i = 0; success && i < inode->extent_cnt; i++) {
+        if (inode->extents[i].start == 0) {
+            idx += inode->extents[i].length;
+            continue;
+        }
+        for (block_sector_t j = 0; success && j < inode->extents[i].length; j++) {
+            success = block_map_set(map, idx++, inode->extents[i].start + j);
         }
     }
-    sectors -= length;
-    if (sectors == 0) return true;
+    if (success)
+        *inode = *map;
+    else
+        release_indirect_blocks(map);
+    free(map);
+    return success;
+}
 
-    length = min(sectors, INDIRECT_BLOCKS_PER_SECTOR);
-    allocate_indirect_inode(&inode->indirect_block, length, 1);
-    sectors -= length;
-    if (sectors == 0) return true;
+/* Allocates up to CNT consecutive sectors as close to GOAL as
+   possible, falling back to shorter runs when the free map is
+   fragmented, and stores the first into *START.  Returns the
+   number allocated, or 0 if the disk is full. */
+static size_t allocate_run(block_sector_t goal, size_t cnt, block_sector_t *start) {
+    for (; cnt > 0; cnt /= 2) {
+        if (free_map_allocate_near(goal, cnt, start))
+            return cnt;
+    }
+    return 0;
+}
 
-    length = min(sectors, INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR);
-    allocate_indirect_inode(&inode->doubly_indirect_block, length, 2);
-    sectors -= length;
-    if (sectors == 0) return true;
+/* Writes zeros to the CNT sectors starting at START. */
+static void zero_sectors(block_sector_t start, size_t cnt) {
+    static char empty_sector[BLOCK_SECTOR_SIZE];
 
-    ASSERT(sectors == 0);
-    return false;
+    for (size_t i = 0; i < cnt; i++) {
+        write_buffer_cache(start + i, empty_sector);
+    }
 }
 
-static void free_indirect_inode(block_sector_t sector, int num_sectors, int depth) {
-    ASSERT(depth <= MAX_DEPTH);
-
-    if (depth == 0) {
-        free_map_release(sector, 1);
-        return;
+/* Allocates zeroed data sectors for up to CNT sectors of the
+   block-mapped INODE starting at IDX, all holes, near GOAL.
+   Returns the number allocated, or 0 on failure. */
+static size_t block_map_fill(struct inode_disk *inode, size_t idx, size_t cnt, block_sector_t goal) {
+    block_sector_t start;
+    size_t got = allocate_run(goal, cnt, &start);
+
+    for (size_t i = 0; i < got; i++) {
+        if (!block_map_set(inode, idx + i, start + i)) {
+            free_map_release(start + i, got - i);
+            got = i;
+        }
     }
+    zero_sectors(start, got);
+    return got;
+}
 
-    block_sector_t indirect_block[INDIRECT_BLOCKS_PER_SECTOR];
-    read_buffer_cache(sector, indirect_block);
+/* Replaces the extent at index I of INODE by the CNT extents in
+   NEW, shifting the extents after it. */
+static void splice_extents(struct inode_disk *inode, size_t i, const struct extent *new, size_t cnt) {
+    ASSERT(inode->extent_cnt - 1 + cnt <= EXTENTS_COUNT);
 
-    int size_unit = depth == 1 ? 1 : INDIRECT_BLOCKS_PER_SECTOR;
-    int length = DIV_ROUND_UP(num_sectors, size_unit);
+    memmove(&inode->extents[i + cnt], &inode->extents[i + 1],
+            (inode->extent_cnt - i - 1) * sizeof *inode->extents);
+    if (cnt > 0)
+        memcpy(&inode->extents[i], new, cnt * sizeof *new);
+    inode->extent_cnt += cnt - 1;
+}
 
-    for (int i = 0; i < length; i++) {
-        int size = min(num_sectors, size_unit);
-        free_indirect_inode(indirect_block[i], size, depth - 1);
-        num_sectors -= size;
+/* Allocates zeroed data sectors for up to CNT sectors of the
+   extent-mapped INODE starting at IDX, all holes, preferably by
+   growing the data extent just before them in place so that the
+   file stays contiguous, or else near GOAL.  Migrates INODE to
+   the block map if it runs out of extents.  Returns the number
+   allocated, or 0 on failure. */
+static size_t extent_fill(struct inode_disk *inode, size_t idx, size_t cnt, block_sector_t goal) {
+    /* Make sure a hole extent covers IDX. */
+    size_t covered = 0;
+    for (size_t i = 0; i < inode->extent_cnt; i++) {
+        covered += inode->extents[i].length;
+    }
+    if (covered < idx + cnt) {
+        struct extent *last = inode->extent_cnt > 0 ? &inode->extents[inode->extent_cnt - 1] : NULL;
+        if (last != NULL && last->start == 0) {
+            last->length += idx + cnt - covered;
+        } else if (inode->extent_cnt < EXTENTS_COUNT) {
+            inode->extents[inode->extent_cnt].start = 0;
+            inode->extents[inode->extent_cnt].length = idx + cnt - covered;
+            inode->extent_cnt++;
+        } else {
+            goto migrate;
+        }
     }
 
-    ASSERT(num_sectors == 0);
-    if (sector != 0) {
-        free_map_release(sector, 1);
+    /* Find it.  Adjacent holes are always merged, so the hole
+       extends at least CNT sectors past IDX. */
+    size_t i, ofs = idx;
+    for (i = 0; ofs >= inode->extents[i].length; i++) {
+        ofs -= inode->extents[i].length;
+    }
+    struct extent hole = inode->extents[i];
+    ASSERT(hole.start == 0 && ofs + cnt <= hole.length);
+
+    if (ofs == 0 && i > 0) {
+        struct extent *prev = &inode->extents[i - 1];
+        block_sector_t start = prev->start + prev->length;
+        size_t got = free_map_extend(start, cnt);
+        if (got > 0) {
+            prev->length += got;
+            if (got == hole.length) {
+                splice_extents(inode, i, NULL, 0);
+            } else {
+                inode->extents[i].length -= got;
+            }
+            zero_sectors(start, got);
+            return got;
+        }
     }
-}
 
-static bool free_inode(struct inode_disk *inode) {
-    int file_length = inode->length;
-    if (file_length < 0) return false;
+    /* Split the hole around a new data extent, which takes up to
+       two more extents. */
+    if (inode->extent_cnt + 2 > EXTENTS_COUNT)
+        goto migrate;
+    struct extent new[3];
+    size_t new_cnt = 0;
+    block_sector_t start;
+    size_t got = allocate_run(goal, cnt, &start);
+    if (got == 0)
+        return 0;
+    if (ofs > 0) {
+        new[new_cnt].start = 0;
+        new[new_cnt++].length = ofs;
+    }
+    new[new_cnt].start = start;
+    new[new_cnt++].length = got;
+    if (ofs + got < hole.length) {
+        new[new_cnt].start = 0;
+        new[new_cnt++].length = hole.length - ofs - got;
+    }
+    splice_extents(inode, i, new, new_cnt);
+    zero_sectors(start, got);
+    return got;
 
-    int sectors = bytes_to_sectors(file_length);
-    int length = min(sectors, DIRECT_BLOCKS_COUNT);
+migrate:
+    if (!migrate_to_block_map(inode))
+        return 0;
+    return block_map_fill(inode, idx, cnt, goal);
+}
 
-    for (int i = 0; i < length; i++) {
-        free_map_release(inode->direct_blocks[i], 1);
+/* Makes sure sectors FIRST through FIRST + CNT - 1 of INODE are
+   allocated, filling the holes among them with zeroed sectors.
+   Each hole is placed right after the sector before it, if that
+   is allocated, and otherwise near HOME, the inode's own sector.
+   Sets *CHANGED to true if INODE had to be modified, which may
+   have happened even if allocation failed partway.  Returns
+   false if the disk is full. */
+static bool allocate_sectors(struct inode_disk *inode, size_t first, size_t cnt, block_sector_t home, bool *changed) {
+    size_t end = first + cnt;
+
+    for (size_t i = first; i < end;) {
+        if (lookup_sector(inode, NULL, i) != 0) {
+            i++;
+            continue;
+        }
+        size_t j = i + 1;
+        while (j < end && lookup_sector(inode, NULL, j) == 0)
+            j++;
+
+        block_sector_t prev = i > 0 ? lookup_sector(inode, NULL, i - 1) : 0;
+        block_sector_t goal = prev != 0 ? prev + 1 : home;
+
+        *changed = true;
+        size_t got = inode->layout == LAYOUT_EXTENTS ? extent_fill(inode, i, j - i, goal) : block_map_fill(inode, i, j - i, goal);
+        if (got == 0)
+            return false;
+        i += got;
     }
-    sectors -= length;
+    return true;
+}
+
+/* Releases indirect block SECTOR of the given DEPTH, 0 for a data
+   sector, along with every sector it maps. */
+static void free_indirect_inode(block_sector_t sector, int depth) {
+    ASSERT(depth <= MAX_DEPTH);
 
-    length = min(sectors, INDIRECT_BLOCKS_PER_SECTOR);
-    if (length > 0) {
-        free_indirect_inode(inode->indirect_block, length, 1);
-        sectors -= length;
+    /* Skip a hole. */
+    if (sector == 0)
+        return;
+
+    if (depth > 0) {
+        block_sector_t indirect_block[INDIRECT_BLOCKS_PER_SECTOR];
+        read_buffer_cache(sector, indirect_block);
+        for (int i = 0; i < INDIRECT_BLOCKS_PER_SECTOR; i++) {
+            free_indirect_inode(indirect_block[i], depth - 1);
+        }
     }
+    free_map_release(sector, 1);
+}
 
-    length = min(sectors, INDIRECT_BLOCKS_PER_SECTOR * INDIRECT_BLOCKS_PER_SECTOR);
-    if (length > 0) {
-        free_indirect_inode(inode->doubly_indirect_block, length, 2);
-        sectors -= length;
+/* Releases every sector INODE maps.  The whole map is walked, not
+   just the part below the length, since a failed write or flush
+   can leave sectors allocated past it. */
+static bool free_inode(struct inode_disk *inode) {
+    if (inode->layout == LAYOUT_INLINE)
+        return true;
+    if (inode->layout == LAYOUT_EXTENTS) {
+        for (size_t i = 0; i < inode->extent_cnt; i++) {
+            if (inode->extents[i].start != 0)
+                free_map_release(inode->extents[i].start, inode->extents[i].length);
+        }
+        return true;
     }
 
-    ASSERT(sectors == 0);
+    for (int i = 0; i < DIRECT_BLOCKS_COUNT; i++) {
+        free_indirect_inode(inode->direct_blocks[i], 0);
+    }
+    free_indirect_inode(inode->indirect_block, 1);
+    free_indirect_inode(inode->doubly_indirect_block, 2);
     return true;
 }
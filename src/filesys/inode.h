@@ -9,7 +9,8 @@ struct bitmap;
 
 typedef enum {
     DIRECTORY,
-    FILE
+    FILE,
+    DIRECTORY_INDEX     /* Name index of a large directory. */
 }InodeType;
 
 void inode_init(void);
@@ -30,12 +31,22 @@ off_t inode_read_at(struct inode *, void *, off_t size, off_t offset);
 
 off_t inode_write_at(struct inode *, const void *, off_t size, off_t offset);
 
+off_t inode_copy_at(struct inode *in, off_t in_ofs, struct inode *out, off_t out_ofs, off_t size);
+
 void inode_deny_write(struct inode *);
 
 void inode_allow_write(struct inode *);
 
+void inode_lock_dir(struct inode *);
+
+void inode_unlock_dir(struct inode *);
+
 off_t inode_length(const struct inode *);
 
+bool inode_sync(struct inode *);
+
+void inode_flush_delayed(void);
+
 bool is_directory(const struct inode *inode);
 
 bool is_removed(const struct inode *inode);
@@ -0,0 +1,689 @@
+#include "filesys/journal.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <hash.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Metadata write-ahead journal.
+
+   Every change to metadata -- inodes, indirect blocks, directory
+   contents and the free map file -- happens inside a transaction
+   bracketed by journal_begin() and journal_end(), and each sector
+   it is about to modify is first passed to journal_log().  The
+   buffer cache keeps a logged sector from reaching its home
+   location until its transaction is committed.
+
+   journal_commit() commits every transaction that has ended since
+   the last commit as one group: it waits for the running
+   transactions to finish, writes the current contents of all
+   their sectors to the log as a chain of records, one after the
+   other, and only then lets the cache write them home.  Replay
+   applies a chain only if all of it made it to the log.  Commits
+   happen when enough sectors are pending, from the write-behind
+   thread before each cache flush, and at shutdown.  Since a held
+   sector pins its cluster in the cache, a group is also committed
+   once its sectors span half of the cache's clusters.  A single
+   transaction can still hold more than the cache, and it cannot
+   be committed before it ends, so the cache then evicts held
+   sectors into the journal's stash instead of writing them home.
+   Mapping their cluster again takes them back, and the commit
+   writes home any still stashed once their record is written.
+
+   The log is a contiguous region that fills from its start.
+   Checkpointing is lazy: only once a commit leaves less than half
+   of the log free does checkpoint() flush the cache, so that every
+   committed sector is home, and start the log over.  It runs at
+   the end of a commit, when the journal holds nothing.  A group
+   that does not fit in what is left of the log starts it over
+   first.  The cache cannot write its sectors home, since their
+   cached copies carry the group's changes, so their last
+   committed copies are written home from the log instead.
+   At mount, journal_open() replays the records written since the
+   last checkpoint, which restores every committed group in full
+   and drops a group whose record was torn by a crash.
+
+   A sector freed while a logged copy of it could still be
+   replayed is not reused until the next checkpoint, or replay
+   could overwrite its new contents.  Each record lists the
+   sectors whose release was deferred since the previous one, so
+   that a crash does not leak them: replay defers them again.  A
+   checkpoint releases them in a record of its own, flagged so
+   that replay knows the free map it logs already has them free,
+   and only then starts the log over.
+
+   Nothing is ever written home ahead of its record.  The only
+   loss of atomicity is for a group larger than the whole log,
+   which is written as several chains with the log started over
+   in between, each of them applied whole or not at all. */
+
+/* Identifies the journal superblock and log records. */
+#define JOURNAL_MAGIC 0x4a524e4c
+#define RECORD_MAGIC 0x4a524543
+
+/* Sectors in the log. */
+#define JOURNAL_SECTORS 256
+
+/* Pending sectors that make journal_end() commit. */
+#define JOURNAL_GROUP_MAX 32
+
+/* Maximum length of a record, in sectors.  Larger groups take a
+   chain of records. */
+#define RECORD_SECTORS 32
+
+/* Sector numbers in the first and in each further descriptor
+   sector of a record. */
+#define DESC_ENTRIES ((BLOCK_SECTOR_SIZE - 7 * sizeof(uint32_t)) / sizeof(block_sector_t))
+#define MORE_DESC_ENTRIES (BLOCK_SECTOR_SIZE / sizeof(block_sector_t))
+
+/* On-disk journal superblock, in JOURNAL_SECTOR. */
+struct journal_super {
+    uint32_t magic;                     /* JOURNAL_MAGIC. */
+    block_sector_t start;               /* First sector of the log. */
+    uint32_t size;                      /* Sectors in the log. */
+    uint32_t seq;                       /* Sequence number of the first record. */
+    uint8_t unused[BLOCK_SECTOR_SIZE - 4 * sizeof(uint32_t)];
+};
+
+/* First sector of a log record.  SECTORS lists the CNT logged
+   sectors and then the FREED sectors released, continuing into
+   further descriptor sectors if needed.  The CNT logged sectors
+   follow, in order. */
+struct journal_record {
+    uint32_t magic;                     /* RECORD_MAGIC. */
+    uint32_t seq;                       /* One more than the previous record. */
+    uint32_t more;                      /* Nonzero if the next record belongs
+                                           to the same chain. */
+    uint32_t cnt;                       /* Sectors logged. */
+    uint32_t freed;                     /* Sectors released, deferred. */
+    uint32_t released;                  /* Nonzero if the free map logged here
+                                           releases every deferred sector. */
+    uint32_t checksum;                  /* Of the whole record, this field 0. */
+    block_sector_t sectors[DESC_ENTRIES];
+};
+
+static bool enabled;                    /* Journal found and opened? */
+static struct journal_super super;
+static block_sector_t log_pos;           /* Next free sector of the log. */
+static uint32_t next_seq;               /* Sequence number of the next record. */
+
+/* Sectors logged by transactions not yet committed: bit I of HELD
+   is set if sector I is among them, PENDING_CNT in all. */
+static struct bitmap *held;
+static size_t pending_cnt;
+static size_t held_clusters;            /* Cache clusters HELD spans. */
+
+/* Uncommitted sectors evicted from the cache, keyed by sector,
+   STASH_CNT in all, protected by journal_lock.  Entries are only
+   added with cache_lock held, so the cache, which holds it when
+   it looks, can skip an empty stash without taking journal_lock. */
+struct stashed_sector {
+    struct hash_elem elem;
+    block_sector_t sector;
+    uint8_t data[BLOCK_SECTOR_SIZE];
+};
+static struct hash stash;
+static size_t stash_cnt;
+
+/* Holds the record being written or read. */
+static uint8_t record_buf[RECORD_SECTORS * BLOCK_SECTOR_SIZE];
+
+/* Sectors with a copy in the log since the last checkpoint, and
+   freed sectors waiting for the next one.  UNRECORDED holds the
+   UNRECORDED_CNT deferred sectors no record lists yet, and is
+   protected by journal_lock. */
+static struct bitmap *in_log;
+static struct bitmap *deferred;
+static struct bitmap *unrecorded;
+static size_t unrecorded_cnt;
+
+/* journal_lock protects active, committer and the pending sectors.
+   journal_quiet is signaled when active drops to 0, journal_idle
+   when a commit ends. */
+static struct lock journal_lock;
+static struct condition journal_quiet, journal_idle;
+static int active;                      /* Transactions running. */
+static struct thread *committer;        /* Thread committing, or null. */
+
+/* Returns true if the pending sectors are numerous enough, or
+   span enough of the cache, to be committed now.  journal_lock
+   must be held. */
+static bool group_full(void) {
+    return pending_cnt >= JOURNAL_GROUP_MAX
+           || held_clusters >= buffer_cache_size / CLUSTER_SECTORS / 2;
+}
+
+/* Returns the number of sectors in a record of CNT sectors that
+   lists FREED released ones. */
+static size_t record_length(size_t cnt, size_t freed) {
+    size_t entries = cnt + freed;
+    size_t desc = 1;
+    if (entries > DESC_ENTRIES)
+        desc += DIV_ROUND_UP(entries - DESC_ENTRIES, MORE_DESC_ENTRIES);
+    return desc + cnt;
+}
+
+/* Stores into *N and *F the largest numbers of the CNT pending
+   and FREED deferred sectors that a record of at most ROOM
+   sectors can take, pending ones first. */
+static void fit_record(size_t room, size_t cnt, size_t freed, size_t *n, size_t *f) {
+    *n = cnt < room ? cnt : room;
+    while (*n > 0 && record_length(*n, 0) > room)
+        --*n;
+    *f = *n == cnt ? freed : 0;
+    while (*f > 0 && record_length(*n, *f) > room)
+        --*f;
+}
+
+/* Returns the number of log sectors that a chain of records for
+   CNT pending and FREED deferred sectors takes. */
+static size_t chain_length(size_t cnt, size_t freed) {
+    size_t len = 0;
+    while (cnt > 0 || freed > 0) {
+        size_t n, f;
+        fit_record(RECORD_SECTORS, cnt, freed, &n, &f);
+        len += record_length(n, f);
+        cnt -= n;
+        freed -= f;
+    }
+    return len;
+}
+
+/* Returns a pointer to entry I of the sector numbers of the record
+   in REC. */
+static block_sector_t *record_entry(void *rec, size_t i) {
+    struct journal_record *r = rec;
+    if (i < DESC_ENTRIES)
+        return &r->sectors[i];
+    i -= DESC_ENTRIES;
+    return (block_sector_t *) ((uint8_t *) rec + BLOCK_SECTOR_SIZE) + i;
+}
+
+/* Returns the checksum of the LEN-sector record in REC. */
+static uint32_t record_checksum(void *rec, size_t len) {
+    struct journal_record *r = rec;
+    uint32_t saved = r->checksum;
+    r->checksum = 0;
+    uint32_t sum = hash_bytes(rec, len * BLOCK_SECTOR_SIZE);
+    r->checksum = saved;
+    return sum;
+}
+
+static unsigned stash_hash(const struct hash_elem *e, void *aux UNUSED) {
+    const struct stashed_sector *s = hash_entry(e, struct stashed_sector, elem);
+    return hash_int(s->sector);
+}
+
+static bool stash_less(const struct hash_elem *a, const struct hash_elem *b, void *aux UNUSED) {
+    return hash_entry(a, struct stashed_sector, elem)->sector
+           < hash_entry(b, struct stashed_sector, elem)->sector;
+}
+
+static void stash_free(struct hash_elem *e, void *aux UNUSED) {
+    free(hash_entry(e, struct stashed_sector, elem));
+}
+
+static void write_super(void) {
+    block_write(fs_device, JOURNAL_SECTOR, &super);
+}
+
+/* Allocates the log and writes an empty journal.  Called while
+   formatting, before journal_open(). */
+void journal_create(void) {
+    static char empty_sector[BLOCK_SECTOR_SIZE];
+
+    ASSERT(sizeof super == BLOCK_SECTOR_SIZE);
+
+    memset(&super, 0, sizeof super);
+    if (!free_map_allocate(JOURNAL_SECTORS, &super.start))
+        PANIC("journal creation failed");
+    super.magic = JOURNAL_MAGIC;
+    super.size = JOURNAL_SECTORS;
+    super.seq = 1;
+    write_super();
+
+    /* A record left by an earlier file system must not replay. */
+    block_write(fs_device, super.start, empty_sector);
+}
+
+/* Reads the record at LOG_POS into record_buf and returns its
+   length in sectors if it is the intact record NEXT_SEQ.
+   Otherwise returns 0. */
+static size_t read_record(void) {
+    struct journal_record *r = (struct journal_record *) record_buf;
+
+    if (log_pos >= super.size)
+        return 0;
+    block_read(fs_device, super.start + log_pos, r);
+    if (r->magic != RECORD_MAGIC || r->seq != next_seq || r->cnt + r->freed == 0
+        || r->cnt > RECORD_SECTORS || r->freed > RECORD_SECTORS * MORE_DESC_ENTRIES)
+        return 0;
+    uint32_t checksum = r->checksum;
+    size_t len = record_length(r->cnt, r->freed);
+    if (len > RECORD_SECTORS || log_pos + len > super.size)
+        return 0;
+
+    block_read_multiple(fs_device, super.start + log_pos, record_buf, len);
+    return record_checksum(record_buf, len) == checksum ? len : 0;
+}
+
+/* Opens the journal and replays the records committed since the
+   last checkpoint.  If they list sectors whose release was still
+   deferred, keeps them in the log and defers those sectors again
+   until the next checkpoint.  Leaves journaling disabled on a file
+   system formatted without a journal. */
+void journal_open(void) {
+    size_t sectors = block_size(fs_device);
+
+    lock_init(&journal_lock);
+    cond_init(&journal_quiet);
+    cond_init(&journal_idle);
+
+    block_read(fs_device, JOURNAL_SECTOR, &super);
+    if (super.magic != JOURNAL_MAGIC) {
+        printf("filesys: no journal, metadata is not crash-safe\n");
+        return;
+    }
+
+    held = bitmap_create(sectors);
+    in_log = bitmap_create(sectors);
+    deferred = bitmap_create(sectors);
+    unrecorded = bitmap_create(sectors);
+    if (held == NULL || in_log == NULL || deferred == NULL || unrecorded == NULL
+        || !hash_init(&stash, stash_hash, stash_less, NULL))
+        PANIC("journal bitmap creation failed");
+
+    /* Find the end of the last complete chain, then replay up to
+       there through the cache and write it all home. */
+    size_t len, end = 0;
+    log_pos = 0;
+    next_seq = super.seq;
+    while ((len = read_record()) > 0) {
+        log_pos += len;
+        next_seq++;
+        if (!((struct journal_record *) record_buf)->more)
+            end = log_pos;
+    }
+
+    int replayed = 0;
+    log_pos = 0;
+    next_seq = super.seq;
+    while (log_pos < end) {
+        struct journal_record *r = (struct journal_record *) record_buf;
+        len = read_record();
+        ASSERT(len > 0);
+        uint8_t *data = record_buf + (len - r->cnt) * BLOCK_SECTOR_SIZE;
+        for (size_t i = 0; i < r->cnt; i++) {
+            write_buffer_cache(*record_entry(r, i), data + i * BLOCK_SECTOR_SIZE);
+            bitmap_mark(in_log, *record_entry(r, i));
+        }
+        if (r->released)
+            bitmap_set_all(deferred, false);
+        for (size_t i = 0; i < r->freed; i++) {
+            block_sector_t sector = *record_entry(r, r->cnt + i);
+            if (sector < sectors)
+                bitmap_mark(deferred, sector);
+        }
+        log_pos += len;
+        next_seq++;
+        replayed++;
+    }
+    if (replayed > 0) {
+        flush_buffer_cache();
+        printf("filesys: replayed %d journal records\n", replayed);
+    }
+
+    /* New records go after the replayed ones if those still list
+       deferred sectors, the only record of them. */
+    if (bitmap_none(deferred, 0, sectors)) {
+        super.seq = next_seq;
+        write_super();
+        log_pos = 0;
+        bitmap_set_all(in_log, false);
+    }
+    enabled = true;
+}
+
+
+/* Starts a transaction, which may be nested in another one of the
+   same thread.  Call it before taking any file system lock: it
+   waits for a commit in progress, and a commit waits for every
+   running transaction to end.  Commits first if the last
+   transactions to end left a full group behind. */
+void journal_begin(void) {
+    struct thread *t = thread_current();
+
+    if (!enabled || t->journal_depth++ > 0)
+        return;
+    lock_acquire(&journal_lock);
+    for (;;) {
+        while (committer != NULL && committer != t)
+            cond_wait(&journal_idle, &journal_lock);
+        if (committer == t || !group_full())
+            break;
+        lock_release(&journal_lock);
+        t->journal_depth--;
+        journal_commit();
+        t->journal_depth++;
+        lock_acquire(&journal_lock);
+    }
+    active++;
+    lock_release(&journal_lock);
+}
+
+/* Ends a transaction started by journal_begin(), committing the
+   group if enough sectors are pending. */
+void journal_end(void) {
+    struct thread *t = thread_current();
+
+    if (!enabled)
+        return;
+    ASSERT(t->journal_depth > 0);
+    if (--t->journal_depth > 0)
+        return;
+
+    lock_acquire(&journal_lock);
+    bool full = group_full() && committer == NULL;
+    if (--active == 0)
+        cond_broadcast(&journal_quiet, &journal_lock);
+    lock_release(&journal_lock);
+    if (full)
+        journal_commit();
+}
+
+/* Adds SECTOR, which the running transaction is about to modify,
+   to the group being built. */
+void journal_log(block_sector_t sector) {
+    if (!enabled)
+        return;
+    ASSERT(thread_current()->journal_depth > 0);
+
+    lock_acquire(&journal_lock);
+    if (!bitmap_test(held, sector)) {
+        block_sector_t cluster = sector - sector % CLUSTER_SECTORS;
+        size_t cnt = bitmap_size(held) - cluster;
+        if (!bitmap_contains(held, cluster, cnt < CLUSTER_SECTORS ? cnt : CLUSTER_SECTORS, true))
+            held_clusters++;
+        bitmap_mark(held, sector);
+        pending_cnt++;
+    }
+    lock_release(&journal_lock);
+}
+
+/* Lets the cache write the pending sectors home, and writes home
+   those it evicted into the stash since write_group() read them.
+   Holding journal_lock meanwhile keeps a miss on their cluster
+   from reading the disk before they are there. */
+static void release_pending(void) {
+    lock_acquire(&journal_lock);
+    struct hash_iterator i;
+    hash_first(&i, &stash);
+    while (hash_next(&i)) {
+        struct stashed_sector *s = hash_entry(hash_cur(&i), struct stashed_sector, elem);
+        block_write(fs_device, s->sector, s->data);
+    }
+    hash_clear(&stash, stash_free);
+    stash_cnt = 0;
+    lock_release(&journal_lock);
+
+    bitmap_set_all(held, false);
+    pending_cnt = 0;
+    held_clusters = 0;
+    wake_buffer_cache();
+}
+
+/* Makes every committed sector home and starts the log over.  The
+   cache writes most of them, but a pending sector's cached copy
+   carries uncommitted changes, so its last copy in the log is
+   written home instead.  No transaction may be running. */
+static void reset_log(void) {
+    flush_buffer_cache();
+
+    size_t end = log_pos;
+    uint32_t seq = next_seq;
+    log_pos = 0;
+    next_seq = super.seq;
+    while (pending_cnt > 0 && log_pos < end) {
+        struct journal_record *r = (struct journal_record *) record_buf;
+        size_t len = read_record();
+        ASSERT(len > 0);
+        uint8_t *data = record_buf + (len - r->cnt) * BLOCK_SECTOR_SIZE;
+        for (size_t i = 0; i < r->cnt; i++) {
+            block_sector_t sector = *record_entry(r, i);
+            if (bitmap_test(held, sector))
+                block_write(fs_device, sector, data + i * BLOCK_SECTOR_SIZE);
+        }
+        log_pos += len;
+        next_seq++;
+    }
+    ASSERT(pending_cnt == 0 || log_pos == end);
+
+    super.seq = next_seq = seq;
+    write_super();
+    log_pos = 0;
+    bitmap_set_all(in_log, false);
+}
+
+/* Writes the pending sectors to the log as a chain of records,
+   along with the list of deferred sectors no record lists yet.
+   RELEASED flags the last record if its free map releases all of
+   them.  No transaction may be running. */
+static void write_group(bool released) {
+    size_t cnt = pending_cnt;
+
+    lock_acquire(&journal_lock);
+    size_t freed = unrecorded_cnt;
+    lock_release(&journal_lock);
+    if (cnt == 0 && freed == 0)
+        return;
+
+    if (log_pos + chain_length(cnt, freed) > super.size)
+        reset_log();
+
+    size_t sector = 0;
+    while (cnt > 0 || freed > 0) {
+        /* A group larger than the log is written a chain at a
+           time, starting the log over whenever it fills up. */
+        size_t room = super.size - log_pos;
+        size_t n, f;
+        fit_record(room < RECORD_SECTORS ? room : RECORD_SECTORS, cnt, freed, &n, &f);
+        if (n + f == 0) {
+            reset_log();
+            continue;
+        }
+        bool last = n == cnt && f == freed;
+        size_t len = record_length(n, f);
+
+        memset(record_buf, 0, (len - n) * BLOCK_SECTOR_SIZE);
+        struct journal_record *r = (struct journal_record *) record_buf;
+        r->magic = RECORD_MAGIC;
+        r->seq = next_seq;
+        r->more = !last && log_pos + len + chain_length(cnt - n, freed - f) <= super.size;
+        r->cnt = n;
+        r->freed = f;
+        r->released = released && last;
+        uint8_t *data = record_buf + (len - n) * BLOCK_SECTOR_SIZE;
+        for (size_t i = 0; i < n; i++) {
+            sector = bitmap_scan(held, sector, 1, true);
+            ASSERT(sector != BITMAP_ERROR);
+            *record_entry(r, i) = sector;
+            read_buffer_cache(sector, data + i * BLOCK_SECTOR_SIZE);
+            bitmap_mark(in_log, sector++);
+        }
+        lock_acquire(&journal_lock);
+        size_t freed_sector = 0;
+        for (size_t i = 0; i < f; i++) {
+            freed_sector = bitmap_scan_and_flip(unrecorded, freed_sector, 1, true);
+            *record_entry(r, n + i) = freed_sector;
+        }
+        unrecorded_cnt -= f;
+        lock_release(&journal_lock);
+        r->checksum = record_checksum(r, len);
+        block_write_multiple(fs_device, super.start + log_pos, record_buf, len);
+
+        log_pos += len;
+        next_seq++;
+        cnt -= n;
+        freed -= f;
+    }
+    release_pending();
+}
+
+/* Frees the sectors whose release waited for a checkpoint and
+   starts the log over.  The free map that releases them is logged
+   first, in a record of its own, so that the log never forgets
+   them before they are free on disk.  No transaction may be
+   running, so none of them can be reused before the log is
+   reset. */
+static void checkpoint(void) {
+    if (bitmap_none(deferred, 0, bitmap_size(deferred))) {
+        reset_log();
+        return;
+    }
+
+    /* Nothing is held, and the log no longer needs to protect the
+       deferred sectors: free them for real. */
+    bitmap_set_all(in_log, false);
+    size_t sector = 0;
+    while ((sector = bitmap_scan_and_flip(deferred, sector, 1, true)) != BITMAP_ERROR) {
+        free_map_release(sector, 1);
+    }
+    lock_acquire(&journal_lock);
+    bitmap_set_all(unrecorded, false);
+    unrecorded_cnt = 0;
+    lock_release(&journal_lock);
+
+    free_map_flush();
+    write_group(true);
+    reset_log();
+}
+
+/* Makes the current thread the committer, once every running
+   transaction has ended.  Until end_commit(), only the committer
+   may start a transaction. */
+static void begin_commit(void) {
+    struct thread *t = thread_current();
+    ASSERT(t->journal_depth == 0);
+
+    lock_acquire(&journal_lock);
+    while (committer != NULL)
+        cond_wait(&journal_idle, &journal_lock);
+    committer = t;
+    while (active > 0)
+        cond_wait(&journal_quiet, &journal_lock);
+    lock_release(&journal_lock);
+}
+
+/* Lets other threads start transactions again. */
+static void end_commit(void) {
+    lock_acquire(&journal_lock);
+    committer = NULL;
+    cond_broadcast(&journal_idle, &journal_lock);
+    lock_release(&journal_lock);
+}
+
+/* Commits every transaction that has ended, together with the
+   free map changes they made, as one group.  Waits for the
+   running transactions to end first. */
+void journal_commit(void) {
+    if (!enabled) {
+        free_map_flush();
+        return;
+    }
+
+    /* The free map goes in the same group as the inodes that use
+       the sectors it allocates. */
+    begin_commit();
+    free_map_flush();
+    write_group(false);
+    if (log_pos > super.size / 2)
+        checkpoint();
+    end_commit();
+}
+
+/* Commits everything, checkpoints and stops journaling, so that
+   the rest of the shutdown writes straight home. */
+void journal_close(void) {
+    if (!enabled)
+        return;
+
+    begin_commit();
+    free_map_flush();
+    write_group(false);
+    checkpoint();
+    enabled = false;
+    end_commit();
+}
+
+/* Returns true if SECTOR holds changes that are not committed,
+   and so must not be written home yet.  Called by the cache with
+   its lock held, so it takes no lock. */
+bool journal_is_held(block_sector_t sector) {
+    return enabled && bitmap_test(held, sector);
+}
+
+/* Stashes a copy of held SECTOR's uncommitted DATA, which the
+   cache is evicting.  Returns false if memory is short.  Called by
+   the cache with its lock held. */
+bool journal_stash(block_sector_t sector, const void *data) {
+    ASSERT(journal_is_held(sector));
+
+    struct stashed_sector *s = malloc(sizeof *s);
+    if (s == NULL)
+        return false;
+    s->sector = sector;
+    memcpy(s->data, data, BLOCK_SECTOR_SIZE);
+
+    lock_acquire(&journal_lock);
+    struct hash_elem *old = hash_insert(&stash, &s->elem);
+    ASSERT(old == NULL);
+    stash_cnt++;
+    lock_release(&journal_lock);
+    return true;
+}
+
+/* If SECTOR is stashed, copies it into DATA, drops it from the
+   stash and returns true.  Called by the cache with its lock held
+   when it maps SECTOR's cluster. */
+bool journal_unstash(block_sector_t sector, void *data) {
+    if (stash_cnt == 0)
+        return false;
+
+    struct stashed_sector key;
+    key.sector = sector;
+    lock_acquire(&journal_lock);
+    struct hash_elem *e = hash_delete(&stash, &key.elem);
+    if (e != NULL)
+        stash_cnt--;
+    lock_release(&journal_lock);
+    if (e == NULL)
+        return false;
+
+    struct stashed_sector *s = hash_entry(e, struct stashed_sector, elem);
+    memcpy(data, s->data, BLOCK_SECTOR_SIZE);
+    free(s);
+    return true;
+}
+
+/* Returns true if SECTOR, which is being freed, has to stay
+   allocated until the next checkpoint, which then frees it.  The
+   next record lists it. */
+bool journal_defer_free(block_sector_t sector) {
+    if (!enabled || (!bitmap_test(held, sector) && !bitmap_test(in_log, sector)))
+        return false;
+    lock_acquire(&journal_lock);
+    bitmap_mark(deferred, sector);
+    if (!bitmap_test(unrecorded, sector)) {
+        bitmap_mark(unrecorded, sector);
+        unrecorded_cnt++;
+    }
+    lock_release(&journal_lock);
+    return true;
+}
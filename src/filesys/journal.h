@@ -0,0 +1,29 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+void journal_create(void);
+
+void journal_open(void);
+
+void journal_close(void);
+
+void journal_begin(void);
+
+void journal_end(void);
+
+void journal_log(block_sector_t sector);
+
+void journal_commit(void);
+
+bool journal_is_held(block_sector_t sector);
+
+bool journal_stash(block_sector_t sector, const void *data);
+
+bool journal_unstash(block_sector_t sector, void *data);
+
+bool journal_defer_free(block_sector_t sector);
+
+#endif /* filesys/journal.h */
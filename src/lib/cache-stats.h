@@ -0,0 +1,19 @@
+#ifndef __LIB_CACHE_STATS_H
+#define __LIB_CACHE_STATS_H
+
+/* Buffer cache counters, shared between the kernel and user
+   programs through the cache_stats system call.  All of them
+   count from boot. */
+struct cache_stats
+  {
+    unsigned long long hits;            /* Lookups found in the cache. */
+    unsigned long long misses;          /* Lookups that had to load. */
+    unsigned long long evictions;       /* Clusters evicted. */
+    unsigned long long write_backs;     /* Dirty sectors written to disk. */
+    unsigned long long read_aheads;     /* Clusters prefetched. */
+    unsigned long long read_ahead_hits; /* Prefetched clusters later used. */
+    unsigned long long lock_waits;      /* Times the cache lock was busy. */
+    unsigned long long lock_wait_ticks; /* Timer ticks spent waiting. */
+  };
+
+#endif /* lib/cache-stats.h */
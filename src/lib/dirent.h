@@ -0,0 +1,19 @@
+#ifndef __LIB_DIRENT_H
+#define __LIB_DIRENT_H
+
+#include <stdbool.h>
+
+/* Longest file name a struct dirent holds, the file system's
+   NAME_MAX. */
+#define DIRENT_NAME_MAX 14
+
+/* A directory entry returned by the getdents system call, which
+   fills an array of them in a single call. */
+struct dirent
+  {
+    int inumber;                        /* Inode number. */
+    bool is_dir;                        /* True if a directory. */
+    char name[DIRENT_NAME_MAX + 1];     /* Null-terminated name. */
+  };
+
+#endif /* lib/dirent.h */
@@ -28,7 +28,14 @@ enum
     SYS_MKDIR,                  /* Create a directory. */
     SYS_READDIR,                /* Reads a directory entry. */
     SYS_ISDIR,                  /* Tests if a fd represents a directory. */
-    SYS_INUMBER                 /* Returns the inode number for a fd. */
+    SYS_INUMBER,                /* Returns the inode number for a fd. */
+
+    /* Extensions. */
+    SYS_CACHE_STATS,            /* Reads the buffer cache counters. */
+    SYS_GETDENTS,               /* Reads many directory entries. */
+    SYS_FSYNC,                  /* Writes a file's changes to disk. */
+    SYS_SYNC,                   /* Writes all changes to disk. */
+    SYS_COPY_RANGE              /* Copies data between two files. */
   };
 
 #endif /* lib/syscall-nr.h */
@@ -182,3 +182,33 @@ inumber (int fd)
 {
   return syscall1 (SYS_INUMBER, fd);
 }
+
+bool
+cache_stats (struct cache_stats *stats)
+{
+  return syscall1 (SYS_CACHE_STATS, stats);
+}
+
+int
+getdents (int fd, struct dirent *entries, unsigned cnt)
+{
+  return syscall3 (SYS_GETDENTS, fd, entries, cnt);
+}
+
+bool
+fsync (int fd)
+{
+  return syscall1 (SYS_FSYNC, fd);
+}
+
+void
+sync (void)
+{
+  syscall0 (SYS_SYNC);
+}
+
+int
+copy_range (int in_fd, int out_fd, unsigned size)
+{
+  return syscall3 (SYS_COPY_RANGE, in_fd, out_fd, size);
+}
@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <debug.h>
+#include <cache-stats.h>
+#include <dirent.h>
 
 /* Process identifier. */
 typedef int pid_t;
@@ -45,4 +47,11 @@ bool readdir (int fd, char name[READDIR_MAX_LEN + 1]);
 bool isdir (int fd);
 int inumber (int fd);
 
+/* Extensions. */
+bool cache_stats (struct cache_stats *);
+int getdents (int fd, struct dirent *, unsigned cnt);
+bool fsync (int fd);
+void sync (void);
+int copy_range (int in_fd, int out_fd, unsigned size);
+
 #endif /* lib/user/syscall.h */
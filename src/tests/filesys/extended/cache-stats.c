@@ -0,0 +1,40 @@
+/* Reads the buffer cache counters, checks that they add up and
+   that reading a file only makes them grow, then passes the
+   cache_stats system call a kernel pointer.  The process must be
+   terminated with -1 exit code. */
+
+#include <cache-stats.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[4096];
+
+void
+test_main (void) 
+{
+  struct cache_stats before, after;
+  int fd;
+
+  CHECK (cache_stats (&before), "cache_stats");
+  CHECK (before.hits + before.misses > 0, "the cache has been used");
+  CHECK (before.read_ahead_hits <= before.read_aheads,
+         "no more read-ahead hits than read-aheads");
+
+  CHECK (create ("file", sizeof buf), "create \"file\"");
+  CHECK ((fd = open ("file")) > 1, "open \"file\"");
+  CHECK (read (fd, buf, sizeof buf) == (int) sizeof buf, "read \"file\"");
+  msg ("close \"file\"");
+  close (fd);
+
+  CHECK (cache_stats (&after), "cache_stats again");
+  CHECK (after.hits + after.misses > before.hits + before.misses
+         && after.evictions >= before.evictions
+         && after.write_backs >= before.write_backs
+         && after.read_aheads >= before.read_aheads
+         && after.lock_waits >= before.lock_waits,
+         "the counters only grew");
+
+  cache_stats ((struct cache_stats *) 0xc0100000);
+  fail ("should not have survived cache_stats()");
+}
@@ -0,0 +1,18 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(cache-stats) begin
+(cache-stats) cache_stats
+(cache-stats) the cache has been used
+(cache-stats) no more read-ahead hits than read-aheads
+(cache-stats) create "file"
+(cache-stats) open "file"
+(cache-stats) read "file"
+(cache-stats) close "file"
+(cache-stats) cache_stats again
+(cache-stats) the counters only grew
+cache-stats: exit(-1)
+EOF
+pass;
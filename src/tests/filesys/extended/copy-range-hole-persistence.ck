@@ -0,0 +1,8 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($src) = "head" . ("\0" x (9000 - 4)) . "tail";
+check_archive ({"src" => [$src],
+		"dst" => [$src x 2]});
+pass;
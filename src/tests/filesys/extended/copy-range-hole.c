@@ -0,0 +1,62 @@
+/* Copies a sparse file with copy_range, asking for more than it
+   holds, then for everything, which the kernel clamps to
+   INT32_MAX, and checks that the hole comes out as zeros and
+   that copies from the end or past it return 0. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define TAIL_OFS 9000
+#define SRC_SIZE (TAIL_OFS + 4)
+
+static char buf[2 * SRC_SIZE];
+
+void
+test_main (void) 
+{
+  int src, dst;
+  int retval;
+
+  CHECK (create ("src", 0), "create \"src\"");
+  CHECK ((src = open ("src")) > 1, "open \"src\"");
+  CHECK (write (src, "head", 4) == 4, "write \"head\" to \"src\"");
+  msg ("seek \"src\" to %d", TAIL_OFS);
+  seek (src, TAIL_OFS);
+  CHECK (write (src, "tail", 4) == 4, "write \"tail\" to \"src\"");
+  CHECK (create ("dst", 0), "create \"dst\"");
+  CHECK ((dst = open ("dst")) > 1, "open \"dst\"");
+
+  msg ("seek \"src\" to 0");
+  seek (src, 0);
+  retval = copy_range (src, dst, 2 * SRC_SIZE);
+  CHECK (retval == SRC_SIZE,
+         "copy_range past the end (must return %d, actually %d)",
+         SRC_SIZE, retval);
+  retval = copy_range (src, dst, 100);
+  CHECK (retval == 0, "copy_range at the end (must return 0, actually %d)",
+         retval);
+
+  msg ("seek \"src\" to 0");
+  seek (src, 0);
+  retval = copy_range (src, dst, 0xffffffff);
+  CHECK (retval == SRC_SIZE,
+         "copy_range 0xffffffff bytes (must return %d, actually %d)",
+         SRC_SIZE, retval);
+  msg ("seek \"src\" to %d", 2 * SRC_SIZE);
+  seek (src, 2 * SRC_SIZE);
+  retval = copy_range (src, dst, 100);
+  CHECK (retval == 0,
+         "copy_range past the end (must return 0, actually %d)", retval);
+  msg ("close \"src\"");
+  close (src);
+  msg ("close \"dst\"");
+  close (dst);
+
+  memcpy (buf, "head", 4);
+  memcpy (buf + TAIL_OFS, "tail", 4);
+  check_file ("src", buf, SRC_SIZE);
+  memcpy (buf + SRC_SIZE, buf, SRC_SIZE);
+  check_file ("dst", buf, 2 * SRC_SIZE);
+}
@@ -0,0 +1,32 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(copy-range-hole) begin
+(copy-range-hole) create "src"
+(copy-range-hole) open "src"
+(copy-range-hole) write "head" to "src"
+(copy-range-hole) seek "src" to 9000
+(copy-range-hole) write "tail" to "src"
+(copy-range-hole) create "dst"
+(copy-range-hole) open "dst"
+(copy-range-hole) seek "src" to 0
+(copy-range-hole) copy_range past the end (must return 9004, actually 9004)
+(copy-range-hole) copy_range at the end (must return 0, actually 0)
+(copy-range-hole) seek "src" to 0
+(copy-range-hole) copy_range 0xffffffff bytes (must return 9004, actually 9004)
+(copy-range-hole) seek "src" to 18008
+(copy-range-hole) copy_range past the end (must return 0, actually 0)
+(copy-range-hole) close "src"
+(copy-range-hole) close "dst"
+(copy-range-hole) open "src" for verification
+(copy-range-hole) verified contents of "src"
+(copy-range-hole) close "src"
+(copy-range-hole) open "dst" for verification
+(copy-range-hole) verified contents of "dst"
+(copy-range-hole) close "dst"
+(copy-range-hole) end
+copy-range-hole: exit(0)
+EOF
+pass;
@@ -0,0 +1,53 @@
+/* Copies between two positions of one file with copy_range.
+   Overlapping ranges must fail and leave both positions alone,
+   while a copy to the end of the same file must extend it. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE 1000
+#define COPY 500
+
+static char buf[SIZE + COPY];
+
+void
+test_main (void) 
+{
+  int fd1, fd2;
+  int retval;
+  int i;
+
+  for (i = 0; i < SIZE; i++)
+    buf[i] = 'a' + i % 26;
+  CHECK (create ("file", 0), "create \"file\"");
+  CHECK ((fd1 = open ("file")) > 1, "open \"file\"");
+  CHECK (write (fd1, buf, SIZE) == SIZE, "write \"file\"");
+  CHECK ((fd2 = open ("file")) > 1, "open \"file\" again");
+
+  msg ("seek to 0 and 100");
+  seek (fd1, 0);
+  seek (fd2, 100);
+  retval = copy_range (fd1, fd2, COPY);
+  CHECK (retval == -1,
+         "copy_range overlapping (must return -1, actually %d)", retval);
+  retval = copy_range (fd1, fd1, 10);
+  CHECK (retval == -1,
+         "copy_range onto itself (must return -1, actually %d)", retval);
+  CHECK (tell (fd1) == 0 && tell (fd2) == 100, "positions unchanged");
+
+  msg ("seek to %d", SIZE);
+  seek (fd2, SIZE);
+  retval = copy_range (fd1, fd2, COPY);
+  CHECK (retval == COPY,
+         "copy_range to the end (must return %d, actually %d)", COPY, retval);
+  CHECK (tell (fd1) == COPY && tell (fd2) == SIZE + COPY, "positions advanced");
+  msg ("close \"file\"");
+  close (fd1);
+  msg ("close \"file\"");
+  close (fd2);
+
+  for (i = 0; i < COPY; i++)
+    buf[SIZE + i] = buf[i];
+  check_file ("file", buf, sizeof buf);
+}
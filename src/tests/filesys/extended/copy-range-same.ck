@@ -0,0 +1,26 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(copy-range-same) begin
+(copy-range-same) create "file"
+(copy-range-same) open "file"
+(copy-range-same) write "file"
+(copy-range-same) open "file" again
+(copy-range-same) seek to 0 and 100
+(copy-range-same) copy_range overlapping (must return -1, actually -1)
+(copy-range-same) copy_range onto itself (must return -1, actually -1)
+(copy-range-same) positions unchanged
+(copy-range-same) seek to 1000
+(copy-range-same) copy_range to the end (must return 500, actually 500)
+(copy-range-same) positions advanced
+(copy-range-same) close "file"
+(copy-range-same) close "file"
+(copy-range-same) open "file" for verification
+(copy-range-same) verified contents of "file"
+(copy-range-same) close "file"
+(copy-range-same) end
+copy-range-same: exit(0)
+EOF
+pass;
@@ -0,0 +1,24 @@
+/* Passes getdents a buffer that runs past the top of user
+   memory, which must fail, then one in kernel memory.  The
+   process must be terminated with -1 exit code. */
+
+#include <dirent.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void) 
+{
+  struct dirent *top = (struct dirent *) ((char *) 0xc0000000 - 8);
+  int fd;
+
+  CHECK (mkdir ("dir"), "mkdir \"dir\"");
+  CHECK (create ("dir/file", 0), "create \"dir/file\"");
+  CHECK ((fd = open ("dir")) > 1, "open \"dir\"");
+  CHECK (getdents (fd, top, 1) == -1,
+         "getdents past the top of user memory returns -1");
+
+  getdents (fd, (struct dirent *) 0xc0100000, 1);
+  fail ("should not have survived getdents()");
+}
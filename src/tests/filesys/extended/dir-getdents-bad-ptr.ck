@@ -0,0 +1,13 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(dir-getdents-bad-ptr) begin
+(dir-getdents-bad-ptr) mkdir "dir"
+(dir-getdents-bad-ptr) create "dir/file"
+(dir-getdents-bad-ptr) open "dir"
+(dir-getdents-bad-ptr) getdents past the top of user memory returns -1
+dir-getdents-bad-ptr: exit(-1)
+EOF
+pass;
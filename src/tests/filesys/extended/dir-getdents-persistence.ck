@@ -0,0 +1,13 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+my ($tree);
+for my $i (0...23) {
+    $tree->{"dir"}{"f$i"} = [''] if $i != 3;
+}
+for my $i (0...7) {
+    $tree->{"dir"}{"d$i"} = {};
+}
+check_archive ($tree);
+pass;
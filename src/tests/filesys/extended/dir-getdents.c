@@ -0,0 +1,97 @@
+/* Reads a directory with getdents, a few entries at a time, so
+   that the batches straddle the directory's sectors, and checks
+   that every entry comes back exactly once with the right type,
+   followed by 0 at the end. */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 24
+#define DIR_CNT 8
+#define REMOVED 3               /* File removed before reading. */
+#define BATCH 5
+
+void
+test_main (void) 
+{
+  struct dirent entries[BATCH];
+  bool seen[FILE_CNT + DIR_CNT];
+  char name[16];
+  int total = 0;
+  int fd;
+  int i;
+
+  CHECK (mkdir ("dir"), "mkdir \"dir\"");
+  msg ("creating %d files and %d directories in \"dir\"", FILE_CNT, DIR_CNT);
+  for (i = 0; i < FILE_CNT; i++)
+    {
+      snprintf (name, sizeof name, "dir/f%d", i);
+      if (!create (name, 0))
+        fail ("create \"%s\"", name);
+    }
+  for (i = 0; i < DIR_CNT; i++)
+    {
+      snprintf (name, sizeof name, "dir/d%d", i);
+      if (!mkdir (name))
+        fail ("mkdir \"%s\"", name);
+    }
+  CHECK (remove ("dir/f3"), "remove \"dir/f3\"");
+
+  CHECK ((fd = open ("dir")) > 1, "open \"dir\"");
+  msg ("getdents \"dir\", %d at a time", BATCH);
+  for (i = 0; i < FILE_CNT + DIR_CNT; i++)
+    seen[i] = false;
+  for (;;)
+    {
+      int n = getdents (fd, entries, BATCH);
+      if (n == 0)
+        break;
+      if (n < 0 || n > BATCH)
+        fail ("getdents returned %d", n);
+
+      for (i = 0; i < n; i++)
+        {
+          const struct dirent *d = &entries[i];
+          int idx = atoi (d->name + 1);
+          snprintf (name, sizeof name, "%c%d", d->name[0], idx);
+          if ((d->name[0] != 'f' && d->name[0] != 'd')
+              || strcmp (name, d->name))
+            fail ("unexpected entry \"%s\"", d->name);
+          if (d->name[0] == 'f')
+            {
+              if (idx < 0 || idx >= FILE_CNT || idx == REMOVED)
+                fail ("unexpected entry \"%s\"", d->name);
+              if (d->is_dir)
+                fail ("\"%s\" reported as a directory", d->name);
+            }
+          else
+            {
+              if (idx < 0 || idx >= DIR_CNT)
+                fail ("unexpected entry \"%s\"", d->name);
+              if (!d->is_dir)
+                fail ("\"%s\" not reported as a directory", d->name);
+              idx += FILE_CNT;
+            }
+          if (seen[idx])
+            fail ("\"%s\" returned twice", d->name);
+          seen[idx] = true;
+          total++;
+        }
+    }
+  if (total != FILE_CNT - 1 + DIR_CNT)
+    fail ("read %d entries, expected %d", total, FILE_CNT - 1 + DIR_CNT);
+  msg ("read %d entries", total);
+  CHECK (getdents (fd, entries, BATCH) == 0, "getdents \"dir\" again returns 0");
+  msg ("close \"dir\"");
+  close (fd);
+
+  CHECK ((fd = open ("dir/f0")) > 1, "open \"dir/f0\"");
+  CHECK (getdents (fd, entries, BATCH) == -1, "getdents \"dir/f0\" returns -1");
+  msg ("close \"dir/f0\"");
+  close (fd);
+}
@@ -0,0 +1,21 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(dir-getdents) begin
+(dir-getdents) mkdir "dir"
+(dir-getdents) creating 24 files and 8 directories in "dir"
+(dir-getdents) remove "dir/f3"
+(dir-getdents) open "dir"
+(dir-getdents) getdents "dir", 5 at a time
+(dir-getdents) read 31 entries
+(dir-getdents) getdents "dir" again returns 0
+(dir-getdents) close "dir"
+(dir-getdents) open "dir/f0"
+(dir-getdents) getdents "dir/f0" returns -1
+(dir-getdents) close "dir/f0"
+(dir-getdents) end
+dir-getdents: exit(0)
+EOF
+pass;
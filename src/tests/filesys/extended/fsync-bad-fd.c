@@ -0,0 +1,23 @@
+/* Passes fsync file descriptors that are not open files, which
+   must all fail. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void) 
+{
+  int fd;
+
+  CHECK (!fsync (0), "fsync stdin fails");
+  CHECK (!fsync (1), "fsync stdout fails");
+  CHECK (!fsync (-1), "fsync -1 fails");
+  CHECK (!fsync (1000), "fsync 1000 fails");
+  CHECK (create ("file", 0), "create \"file\"");
+  CHECK ((fd = open ("file")) > 1, "open \"file\"");
+  CHECK (!fsync (fd + 1), "fsync unopened fd fails");
+  msg ("close \"file\"");
+  close (fd);
+  CHECK (!fsync (fd), "fsync closed fd fails");
+}
@@ -0,0 +1,19 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fsync-bad-fd) begin
+(fsync-bad-fd) fsync stdin fails
+(fsync-bad-fd) fsync stdout fails
+(fsync-bad-fd) fsync -1 fails
+(fsync-bad-fd) fsync 1000 fails
+(fsync-bad-fd) create "file"
+(fsync-bad-fd) open "file"
+(fsync-bad-fd) fsync unopened fd fails
+(fsync-bad-fd) close "file"
+(fsync-bad-fd) fsync closed fd fails
+(fsync-bad-fd) end
+fsync-bad-fd: exit(0)
+EOF
+pass;
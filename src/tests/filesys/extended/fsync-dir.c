@@ -0,0 +1,19 @@
+/* Syncs a directory before and after adding a file to it. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void) 
+{
+  int fd;
+
+  CHECK (mkdir ("dir"), "mkdir \"dir\"");
+  CHECK ((fd = open ("dir")) > 1, "open \"dir\"");
+  CHECK (fsync (fd), "fsync \"dir\"");
+  CHECK (create ("dir/file", 0), "create \"dir/file\"");
+  CHECK (fsync (fd), "fsync \"dir\" again");
+  msg ("close \"dir\"");
+  close (fd);
+}
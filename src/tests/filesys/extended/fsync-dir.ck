@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(fsync-dir) begin
+(fsync-dir) mkdir "dir"
+(fsync-dir) open "dir"
+(fsync-dir) fsync "dir"
+(fsync-dir) create "dir/file"
+(fsync-dir) fsync "dir" again
+(fsync-dir) close "dir"
+(fsync-dir) end
+fsync-dir: exit(0)
+EOF
+pass;
@@ -0,0 +1,7 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_archive ({"fsynced" => ["f" x 6000],
+		"synced" => ["s" x 70000]});
+pass;
@@ -0,0 +1,39 @@
+/* Writes one file and syncs it with fsync, then writes another
+   and syncs the whole file system, so that both survive to the
+   persistence check. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[70000];
+
+static void
+write_file (const char *file_name, char c, size_t size, bool use_fsync) 
+{
+  int fd;
+
+  memset (buf, c, size);
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, buf, size) == (int) size, "write \"%s\"", file_name);
+  if (use_fsync)
+    CHECK (fsync (fd), "fsync \"%s\"", file_name);
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
+
+void
+test_main (void) 
+{
+  write_file ("fsynced", 'f', 6000, true);
+  write_file ("synced", 's', sizeof buf, false);
+  msg ("sync");
+  sync ();
+
+  memset (buf, 'f', 6000);
+  check_file ("fsynced", buf, 6000);
+  memset (buf, 's', sizeof buf);
+  check_file ("synced", buf, sizeof buf);
+}
@@ -0,0 +1,26 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected ([<<'EOF']);
+(sync-persist) begin
+(sync-persist) create "fsynced"
+(sync-persist) open "fsynced"
+(sync-persist) write "fsynced"
+(sync-persist) fsync "fsynced"
+(sync-persist) close "fsynced"
+(sync-persist) create "synced"
+(sync-persist) open "synced"
+(sync-persist) write "synced"
+(sync-persist) close "synced"
+(sync-persist) sync
+(sync-persist) open "fsynced" for verification
+(sync-persist) verified contents of "fsynced"
+(sync-persist) close "fsynced"
+(sync-persist) open "synced" for verification
+(sync-persist) verified contents of "synced"
+(sync-persist) close "synced"
+(sync-persist) end
+sync-persist: exit(0)
+EOF
+pass;
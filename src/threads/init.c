@@ -40,6 +40,7 @@
 #include "devices/ide.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/cache.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -259,6 +260,24 @@ parse_options(char **argv)
       filesys_bdev_name = value;
     else if (!strcmp(name, "-scratch"))
       scratch_bdev_name = value;
+    else if (!strcmp(name, "-cache-policy"))
+      {
+        if (value == NULL || !set_buffer_cache_policy(value))
+          PANIC("unknown buffer cache policy `%s'", value != NULL ? value : "");
+      }
+    else if (!strcmp(name, "-cache"))
+      {
+        int sectors = value != NULL ? atoi(value) : 0;
+        if (sectors <= 0)
+          PANIC("-cache needs a positive number of sectors");
+        buffer_cache_size = sectors;
+      }
+    else if (!strcmp(name, "-cache-flush"))
+      {
+        if (value == NULL || atoi(value) < 0)
+          PANIC("-cache-flush needs a number of ticks, 0 to disable");
+        buffer_cache_flush_interval = atoi(value);
+      }
 #ifdef VM
     else if (!strcmp(name, "-swap"))
       swap_bdev_name = value;
@@ -327,6 +346,7 @@ run_actions(char **argv)
           {"rm", 2, fsutil_rm},
           {"extract", 1, fsutil_extract},
           {"append", 2, fsutil_append},
+          {"cache-bench", 1, bench_buffer_cache},
 #endif
           {NULL, 0, NULL},
       };
@@ -372,6 +392,7 @@ usage(void)
          "  ls                 List files in the root directory.\n"
          "  cat FILE           Print FILE to the console.\n"
          "  rm FILE            Delete FILE.\n"
+         "  cache-bench        Measure buffer cache lookup cost.\n"
          "Use these actions indirectly via `pintos' -g and -p options:\n"
          "  extract            Untar from scratch device into file system.\n"
          "  append FILE        Append FILE to tar file on scratch device.\n"
@@ -384,6 +405,16 @@ usage(void)
          "  -f                 Format file system device during startup.\n"
          "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
          "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+         "  -cache=SECTORS     Cache SECTORS file system sectors (default 64),\n"
+         "                     rounded up to whole 8-sector clusters.\n"
+         "                     Comes out of the kernel pool, which gets half\n"
+         "                     of free RAM unless -ul shrinks the user pool.\n"
+         "  -cache-policy=POLICY  Evict buffer cache entries by POLICY:\n"
+         "                     clock (default), 2q or first.\n"
+         "  -cache-flush=TICKS Write dirty cache entries back every TICKS\n"
+         "                     timer ticks (default 500), 0 to disable,\n"
+         "                     which keeps data appended to closed files\n"
+         "                     in memory until sync.\n"
 #ifdef VM
          "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
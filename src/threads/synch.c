@@ -300,3 +300,67 @@ void cond_broadcast(struct condition *cond, struct lock *lock) {
     while (!list_empty(&cond->waiters))
         cond_signal(cond, lock);
 }
+
+/* Initializes RW, a readers-writer lock.  Any number of threads
+   may hold it for reading at once, or a single thread for
+   writing.  A waiting writer keeps new readers out, so that a
+   stream of readers cannot starve it.  Like a lock, it must be
+   released by the thread that acquired it, and it is not
+   recursive: a thread holding it must not acquire it again. */
+void rwlock_init(struct rwlock *rw) {
+    ASSERT(rw != NULL);
+
+    lock_init(&rw->lock);
+    cond_init(&rw->can_read);
+    cond_init(&rw->can_write);
+    rw->readers = 0;
+    rw->waiting_writers = 0;
+    rw->writer = NULL;
+}
+
+/* Acquires RW for reading, sleeping until no writer holds it or
+   waits for it. */
+void rwlock_acquire_read(struct rwlock *rw) {
+    ASSERT(!intr_context());
+
+    lock_acquire(&rw->lock);
+    while (rw->writer != NULL || rw->waiting_writers > 0)
+        cond_wait(&rw->can_read, &rw->lock);
+    rw->readers++;
+    lock_release(&rw->lock);
+}
+
+/* Releases RW, which the current thread holds for reading. */
+void rwlock_release_read(struct rwlock *rw) {
+    lock_acquire(&rw->lock);
+    ASSERT(rw->readers > 0);
+    if (--rw->readers == 0)
+        cond_signal(&rw->can_write, &rw->lock);
+    lock_release(&rw->lock);
+}
+
+/* Acquires RW for writing, sleeping until nobody else holds it. */
+void rwlock_acquire_write(struct rwlock *rw) {
+    ASSERT(!intr_context());
+    ASSERT(rw->writer != thread_current());
+
+    lock_acquire(&rw->lock);
+    rw->waiting_writers++;
+    while (rw->writer != NULL || rw->readers > 0)
+        cond_wait(&rw->can_write, &rw->lock);
+    rw->waiting_writers--;
+    rw->writer = thread_current();
+    lock_release(&rw->lock);
+}
+
+/* Releases RW, which the current thread holds for writing. */
+void rwlock_release_write(struct rwlock *rw) {
+    lock_acquire(&rw->lock);
+    ASSERT(rw->writer == thread_current());
+    rw->writer = NULL;
+    if (rw->waiting_writers > 0)
+        cond_signal(&rw->can_write, &rw->lock);
+    else
+        cond_broadcast(&rw->can_read, &rw->lock);
+    lock_release(&rw->lock);
+}
@@ -117,6 +117,7 @@ struct thread
 
     struct dir *cwd;        //current working directory of this thread
     struct dir *directories[FILE_MAX_COUNT];
+    int journal_depth;      //nesting depth of journal transactions
 
     /* Owned by thread.c. */
     unsigned magic; /* Detects stack overflow. */
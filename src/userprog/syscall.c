@@ -12,6 +12,7 @@
 #include "../filesys/inode.h"
 #include "../filesys/file.h"
 #include "../filesys/directory.h"
+#include "../filesys/cache.h"
 
 #define USER_LOWER_BOUND 0x08048000
 
@@ -25,10 +26,14 @@ static void load_and_pin_pages(void *buffer, size_t size);
 
 static void unpin_pages(void *buffer, size_t size);
 
-struct lock file_lock;
+/* There is no lock around file system calls here: the file
+   system synchronizes itself, with a readers-writer lock per
+   inode, a lock per directory and locks on the free map, the
+   open inode table and the buffer cache, so calls on unrelated
+   files run in parallel, even while waiting for the disk.  The
+   descriptor tables are per thread and need no lock. */
 
 void syscall_init(void) {
-    lock_init(&file_lock);
     intr_register_int(0x30, 3, INTR_ON, syscall_handler, "syscall");
 }
 
@@ -64,9 +69,7 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
             const char *file = (const char *) *((int *) f->esp + 1);
             unsigned initial_size = (unsigned) *((int *) f->esp + 2);
 
-            lock_acquire(&file_lock);
             f->eax = create(file, initial_size);
-            lock_release(&file_lock);
             break;
         }
         case SYS_REMOVE: {
@@ -74,9 +77,7 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
 
             const char *file = (const char *) *((int *) f->esp + 1);
 
-            lock_acquire(&file_lock);
             f->eax = remove(file);
-            lock_release(&file_lock);
             break;
         }
         case SYS_OPEN: {
@@ -84,9 +85,7 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
 
             const char *file = (const char *) *((int *) f->esp + 1);
 
-            lock_acquire(&file_lock);
             f->eax = open(file);
-            lock_release(&file_lock);
             break;
         }
         case SYS_FILESIZE: {
@@ -94,9 +93,7 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
 
             int fd = *((int *) f->esp + 1);
 
-            lock_acquire(&file_lock);
             f->eax = filesize(fd);
-            lock_release(&file_lock);
             break;
         }
         case SYS_READ: {
@@ -109,9 +106,7 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
             void *buffer = (void *) (*((int *) f->esp + 2));
             unsigned size = *((unsigned *) f->esp + 3);
 
-            lock_acquire(&file_lock);
             f->eax = read(fd, buffer, size);
-            lock_release(&file_lock);
             break;
         }
         case SYS_WRITE: {
@@ -121,9 +116,7 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
             void *buffer = (void *) (*((int *) f->esp + 2));
             unsigned size = *((unsigned *) f->esp + 3);
 
-            lock_acquire(&file_lock);
             f->eax = write(fd, buffer, size);
-            lock_release(&file_lock);
             break;
         }
         case SYS_SEEK: {
@@ -132,9 +125,7 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
             int fd = *((int *) f->esp + 1);
 
             unsigned position = (unsigned) *((int *) f->esp + 2);
-            lock_acquire(&file_lock);
             seek(fd, position);
-            lock_release(&file_lock);
             break;
         }
         case SYS_TELL: {
@@ -142,9 +133,7 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
 
             int fd = *((int *) f->esp + 1);
 
-            lock_acquire(&file_lock);
             f->eax = tell(fd);
-            lock_release(&file_lock);
             break;
         }
         case SYS_CLOSE: {
@@ -152,9 +141,7 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
 
             int fd = *((int *) f->esp + 1);
 
-            lock_acquire(&file_lock);
             close(fd);
-            lock_release(&file_lock);
             break;
         }
         case SYS_MMAP: {
@@ -172,39 +159,57 @@ static void syscall_handler(struct intr_frame *f UNUSED) {
         case SYS_CHDIR: {
             char *dir = (char *) *((int *) f->esp + 1);
             check_address_validity(dir);
-            lock_acquire(&file_lock);
             f->eax = chdir(dir);
-            lock_release(&file_lock);
             break;
         }
         case SYS_MKDIR: {
             char *dir = (char *) *((int *) f->esp + 1);
             check_address_validity(dir);
-            lock_acquire(&file_lock);
             f->eax = mkdir(dir);
-            lock_release(&file_lock);
             break;
         }
         case SYS_READDIR: {
             int fd = *((int *) f->esp + 1);
             char *name = (char *) (*((int *) f->esp + 2));
-            lock_acquire(&file_lock);
             f->eax = readdir(fd, name);
-            lock_release(&file_lock);
             break;
         }
         case SYS_ISDIR: {
             int fd = *((int *) f->esp + 1);
-            lock_acquire(&file_lock);
             f->eax = isdir(fd);
-            lock_release(&file_lock);
             break;
         }
         case SYS_INUMBER: {
             int fd = *((int *) f->esp + 1);
-            lock_acquire(&file_lock);
             f->eax = inumber(fd);
-            lock_release(&file_lock);
+            break;
+        }
+        case SYS_CACHE_STATS: {
+            struct cache_stats *stats = (struct cache_stats *) *((int *) f->esp + 1);
+            f->eax = cache_stats(stats);
+            break;
+        }
+        case SYS_GETDENTS: {
+            int fd = *((int *) f->esp + 1);
+            struct dirent *entries = (struct dirent *) (*((int *) f->esp + 2));
+            unsigned cnt = *((unsigned *) f->esp + 3);
+            f->eax = getdents(fd, entries, cnt);
+            break;
+        }
+        case SYS_FSYNC: {
+            int fd = *((int *) f->esp + 1);
+            f->eax = fsync(fd);
+            break;
+        }
+        case SYS_SYNC: {
+            sync();
+            break;
+        }
+        case SYS_COPY_RANGE: {
+            int in_fd = *((int *) f->esp + 1);
+            int out_fd = *((int *) f->esp + 2);
+            unsigned size = *((unsigned *) f->esp + 3);
+            f->eax = copy_range(in_fd, out_fd, size);
             break;
         }
     }
@@ -217,9 +222,6 @@ void halt(void) {
 void exit(int status) {
     printf("%s: exit(%d)\n", thread_name(), status);
     thread_current()->exit_status = status;
-    if (lock_held_by_current_thread(&file_lock)) {
-        lock_release(&file_lock);
-    }
 
     thread_exit();
 }
@@ -371,7 +373,6 @@ mapid_t mmap(int fd, void *addr) {
     if (fd == 0 || fd == 1 || !is_user_vaddr(addr) || pg_ofs(addr) != 0 || addr == NULL) {
         return -1;
     }
-    lock_acquire(&file_lock);
     struct thread *current_thread = thread_current();
     struct file *f = NULL;
     struct file *target = current_thread->files[fd];
@@ -417,11 +418,9 @@ mapid_t mmap(int fd, void *addr) {
     mme->file_size = file_size;
     list_push_back(&current_thread->mmap_table, &mme->mmap_elem);
 
-    lock_release(&file_lock);
     return mid;
 
     MMAP_FAIL:
-    lock_release(&file_lock);
     return -1;
 }
 
@@ -431,7 +430,6 @@ void munmap(mapid_t mapping) {
     if (mme == NULL) {
         exit(-1);
     }
-    lock_acquire(&file_lock);
     size_t file_size = mme->file_size;
     for (int ofs = 0; ofs < file_size; ofs += PGSIZE) {
         void *upage = mme->upage + ofs;
@@ -442,7 +440,6 @@ void munmap(mapid_t mapping) {
     list_remove(&mme->mmap_elem);
     file_close(mme->file);
     free(mme);
-    lock_release(&file_lock);
 }
 
 bool chdir(const char *dir) {
@@ -484,6 +481,80 @@ int inumber(int fd) {
     }
 }
 
+bool cache_stats(struct cache_stats *stats) {
+    struct cache_stats s;
+
+    can_i_write(stats, sizeof *stats);
+    /* Copy out only after the cache lock is released, since
+       touching user memory may fault. */
+    get_buffer_cache_stats(&s);
+    *stats = s;
+    return true;
+}
+
+/* Fills ENTRIES with up to CNT entries of directory FD, following
+   the ones already read, and returns how many, 0 at the end of the
+   directory, or -1 if FD is not an open directory or CNT entries
+   would not fit in user memory. */
+int getdents(int fd, struct dirent *entries, unsigned cnt) {
+    if (fd < 0 || fd >= FILE_MAX_COUNT || thread_current()->directories[fd] == NULL)
+        return -1;
+    if (cnt > SIZE_MAX / sizeof *entries
+        || cnt * sizeof *entries > (size_t) ((uint8_t *) PHYS_BASE - (uint8_t *) entries))
+        return -1;
+
+    size_t size = cnt * sizeof *entries;
+    can_i_write(entries, size);
+#ifdef VM
+    load_and_pin_pages(entries, size);
+#endif
+    int read_cnt = dir_read_entries(thread_current()->directories[fd], entries, cnt);
+#ifdef VM
+    unpin_pages(entries, size);
+#endif
+    return read_cnt;
+}
+
+/* Writes the changes to file or directory FD to disk, returning
+   once they are durable.  Returns false if FD is not open or if
+   data written to it was lost because the disk filled up. */
+bool fsync(int fd) {
+    if (fd < 2 || fd >= FILE_MAX_COUNT)
+        return false;
+
+    struct thread *t = thread_current();
+    struct inode *inode;
+    if (t->files[fd] != NULL)
+        inode = file_get_inode(t->files[fd]);
+    else if (t->directories[fd] != NULL)
+        inode = dir_get_inode(t->directories[fd]);
+    else
+        return false;
+    return inode_sync(inode);
+}
+
+/* Writes every change to the file system to disk. */
+void sync(void) {
+    filesys_sync();
+}
+
+/* Copies up to SIZE bytes from file IN_FD to file OUT_FD, from
+   and to their current positions, inside the kernel.  Returns the
+   number of bytes copied, 0 at the end of IN_FD, or -1 if either
+   is not an open file or nothing could be copied, for example
+   because the disk is full. */
+int copy_range(int in_fd, int out_fd, unsigned size) {
+    if (in_fd < 2 || in_fd >= FILE_MAX_COUNT || out_fd < 2 || out_fd >= FILE_MAX_COUNT)
+        return -1;
+
+    struct thread *t = thread_current();
+    if (t->files[in_fd] == NULL || t->files[out_fd] == NULL)
+        return -1;
+    if (size > INT32_MAX)
+        size = INT32_MAX;
+    return file_copy(t->files[in_fd], t->files[out_fd], size);
+}
+
 void check_address_validity(void *address) {
     if (!(is_user_vaddr(address))) {
         exit(-1);
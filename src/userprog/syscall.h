@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <debug.h>
+#include <cache-stats.h>
+#include <dirent.h>
 #include "../threads/thread.h"
 
 typedef int pid_t;
@@ -45,4 +47,14 @@ bool isdir(int fd);
 
 int inumber(int fd);
 
+bool cache_stats(struct cache_stats *stats);
+
+int getdents(int fd, struct dirent *entries, unsigned cnt);
+
+bool fsync(int fd);
+
+void sync(void);
+
+int copy_range(int in_fd, int out_fd, unsigned size);
+
 #endif /* userprog/syscall.h */